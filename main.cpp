@@ -1,16 +1,177 @@
 ////David Tanase, CSCE 313-200, Spring 2024
 #include "pch.h"
 #include <unordered_set>
+#include <unordered_map>
+#include <vector>
 #include <algorithm>
+#include <math.h>
+#include <intrin.h>
+#include <bzlib.h> // NOTE: link with libbz2.lib for .bz2 input
+
 #define EOB 1
 
+#define READER_SYNC 0 // one blocking ReadFile per slot through the file cache
+#define READER_OVERLAPPED 1 // unbuffered overlapped reads, several per slot in flight
+#define READER_MAPPED 2 // workers take byte ranges straight out of a view of the whole file
+#define READER_PARALLEL 3 // several threads read disjoint chunks; split words are stitched afterwards
+#define READER_BZIP2 4 // independent streams of a multistream .bz2 are decompressed in parallel
+
+#define SCAN_BLOCK (1 << 23) // read size when scanning a .bz2 for stream headers
+
+#define TUNE_START_EXP 16 // chunk size the tuner starts from when buf_size is "auto"
+#define TUNE_MAX_EXP 24
+#define TUNE_SAMPLE_MS 25 // queue occupancy is sampled this often
+#define TUNE_EPOCH_SAMPLES 10 // samples per measurement
+#define TUNE_EPOCHS 16 // measurements before the settings are frozen
+
+#define CACHE_NORMAL 0 // leave file pages to the cache manager
+#define CACHE_STREAM 1 // read sequentially at low memory priority; only the mapped reader can also drop ranges once consumed
+
+#define PAGES_NORMAL 0 // table memory and slots in 4 KB pages
+#define PAGES_LARGE 1 // blocks of a large page or more in large pages, if the process may lock memory
+#define SMALL_PAGE 4096
+
+#define PLACE_NONE 0 // worker i runs on processor i of the first group, memory lands where it is first touched
+#define PLACE_NUMA 1 // workers spread over the NUMA nodes; slots and tables on the node that uses them
+#define NODES_MAX 63 // NUMA nodes told apart; a worker waits on a queue per node plus the quit event
+#define ARENA_INITIAL (64 << 10) // first committed size of a table's word arena, which then doubles
+#define ARENA_SPAN (64ULL << 30) // address space reserved for a word arena, at most
+#define ARENA_SPACE (32ULL << 40) // address space of all word arenas together, a quarter of what a process has
+
+#define STREAM_AHEAD 4 // chunks the mapped reader prefetches ahead of the workers under CACHE_STREAM
+
+#define SIMD_SCALAR 0 // tokenizer kernels, in order of preference
+#define SIMD_SSE42 1
+#define SIMD_AVX2 2
+#define SIMD_AVX512 3
+
+#define HASH_SBOX 0 // per-letter table lookups, each step waits on the previous one
+#define HASH_MIX 1 // whole word in 8-byte lanes, mixed with independent 64x64->128 multiplies
+#define CASE_FOLD(lane) ((lane) | (~(lane) & 0x8080808080808080ULL) >> 2) // sets the lower-case bit of every ASCII byte in a lane
+
+#define KEYS_HASH 0 // a word is known by its 64-bit hash, and its string is stored next to it
+#define KEYS_PACKED 1 // ASCII words are packed into exact keys of 5 bits per letter
+#define PACKED_LANE 12 // letters per 64-bit lane of a packed key
+#define PACKED_LONG (1ULL << 63) // set in the first lane of a key that needs all three lanes
+
+#define TABLE_CHAIN 0 // nBins bins of offsets, collisions chained through mainHashBuf
+#define TABLE_SWISS 1 // open addressing over groups of 16 slots with a control byte each
+#define TABLE_SHARED 2 // one table for all workers, slots claimed with compare-and-swap
+#define CHAIN_MAX_LOAD 2 // entries per bin before the bins double
+#define CHAIN_MIGRATE 8 // old bins moved to the doubled bins per insert
+#define CHAIN_END -1 // offset that ends a chain
+#define PACKED_UNIT 16 // packed entries link to each other in units of this many bytes
+#define PACKED_UNIT_END 0xFFFFFFFF // unit link that ends a chain
+#define SWISS_GROUP 16 // slots whose control bytes one SSE2 compare checks
+#define SWISS_EMPTY 0x80 // control byte of a free slot; a used one holds 7 bits of the hash
+#define SWISS_MOVED 0xFE // control byte of an old slot whose key has moved to the doubled table
+#define SWISS_MAX_LOAD 7 // eighths of the slots that may be used before the table doubles
+#define SWISS_MIGRATE 2 // old groups moved to the doubled table per lookup
+#define SHARED_TAG 0xFFFF000000000000ULL // hash bits kept in a shared slot next to the entry address
+#define SHARED_ARENA_CHUNK (2 << 20) // bytes a worker takes for shared entries at a time, one large page
+#define MERGE_PARTS_MAX 256 // partitions of the worker tables, merged side by side
+#define MERGE_PART_SHIFT 48 // hash bits that pick the partition; bins and SwissTable tags use others
+#define MERGE_PART_MIN_BINS 4096 // initial bins of a partition, however many partitions there are
+#define INSERT_BATCH 32 // words whose table lines are prefetched before the first of them is counted
+#define INSERT_BATCH_MAX 256
+#define SORT_COUNTS 256 // counts below this get report groups of their own, one per first byte
+#define REPORT_LINES 65536 // listing lines a thread formats at a time
+#define REPORT_LINE_EXTRA 64 // longest line without its word: rank, count, error and punctuation
+#define REPORT_PARTS_MAX 1024
+#define INDEX_MAGIC "WIKIDX1" // 8 bytes with the terminator
+#define INDEX_BLOCK 16 // words per front-coded block of a word index; the first of each is stored whole
+#define INDEX_WORD_MAX 128 // longer than any word the tokenizer takes
+
+#define COUNT_EXACT 0 // every word gets a counter of its own
+#define COUNT_HEAVY 1 // only the most frequent words are kept, in a fixed number of Space-Saving counters
+#define COUNT_ESTIMATE 2 // no words are kept, a HyperLogLog sketch of their hashes estimates how many differ
+#define HEAVY_COUNTERS 100000 // counters per worker under COUNT_HEAVY
+#define HEAVY_FREE 0xFFFFFFFFFFFFFFFFULL // free entry of a SpaceSaving index
+#define HLL_PRECISION 12 // hash bits that pick a HyperLogLog register; the estimate is within 1.04 / 2^6 = 1.6% typically
+#define HLL_REGISTERS (1 << HLL_PRECISION)
+
+#define CHARSET_ASCII 0 // letters are a-z and A-Z, every other byte is a non-letter
+#define CHARSET_UTF8 1 // also the two-byte letters of Latin-1, Latin Extended-A, Greek and Cyrillic
+#define CHAR_OTHER 0 // classes of a decoded character
+#define CHAR_LETTER 1
+#define CHAR_DELIM 2
+#define LONGEST_WORD_UTF8 72 // 31 two-byte letters and a three-byte delimiter, rounded up
+
+#define FILTER_NONE 0 // the tokenizer sees the input as it is
+#define FILTER_WIKI 1 // XML tags, dump metadata and wikitext markup are blanked before tokenizing
+#define FILTER_NAME_MAX 24 // longest tag or entity name the filter tells apart
+#define FILTER_TAG_MAX 512 // a wikitext '<' that runs on this long without a '>' was not a tag
+#define XML_TEXT 0 // states of the XML layer of MarkupFilter
+#define XML_TAG 1
+#define XML_ENTITY 2
+#define EXT_NONE 0 // states of an external link [url label]
+#define EXT_PREFIX 1 // after '[', the bytes so far may still start a URL
+#define EXT_URL 2
+#define EXT_LABEL 3
+
+#define MAX_IO_SIZE (1 << 18) // largest single request issued by the overlapped reader
+#define IO_ALIGN 4096 // covers both 512e and 4Kn volumes for unbuffered reads
+
 class MyBuf {
 public:
     char* ptr; // pointer to buffer to search
     int size; // buffer size
     int slotID; // ID of the slot to return back
+    DWORD bytes; // bytes of the chunk itself, without shadow or lead
     UINT64 offset; // offset in the file (may be needed for debugging)
     bool first;
+    bool stitch; // no shadow in front; words cut by the chunk edges go through StitchEdge
+    bool last;
+    UINT64 seq; // edge key of the chunk start, for stitching; chunk order for the markup filter
+    UINT64 nextSeq; // edge key of the chunk end, i.e. seq of the chunk that follows
+    int fileID; // index into the input list
+};
+
+// letters a chunk contributes to a word that crosses one of its edges
+class WordFragment {
+public:
+    char letters[LONGEST_WORD_UTF8]; // only the first lenLongestWord bytes matter, longer words are never eligible
+    DWORD len;
+    DWORD wide; // continuation bytes of multi-byte letters among the len bytes
+    char delim; // the non-letter on the far side of the fragment; a multi-byte one is ' ' if it is a delimiter, '\x01' if not
+    bool allAlpha; // the whole chunk is letters, so the word runs on past it
+    bool eof; // nothing follows the fragment
+    UINT64 nextKey; // for allAlpha, the edge at the far end of the chunk
+};
+
+// compressed byte range of one or more whole bzip2 streams
+class StreamRange {
+public:
+    UINT64 index; // position across all inputs, (UINT64)-1 tells a decoder to quit
+    UINT64 start;
+    UINT64 end;
+    int fileID;
+    bool first;
+    bool last;
+};
+
+class InputFile {
+public:
+    char* name;
+    UINT64 size;
+    UINT64 firstChunk; // global number of the file's first chunk
+    UINT64 nChunks;
+    char* mapBase; // view of the file for READER_MAPPED
+
+    UINT64 bytes; // bytes handed to the tokenizer, decompressed for .bz2
+    UINT64 words;
+    UINT64 invalid;
+};
+
+class ChunkEdge {
+public:
+    WordFragment left; // tail of the chunk in front of the edge
+    WordFragment right; // head of the chunk behind it
+    int arrivals;
+
+    ChunkEdge() {
+        arrivals = 0;
+    }
 };
 
 class HashValue {
@@ -34,11 +195,40 @@ public:
     }
 };
 
+// an ASCII word as an exact key, 5 bits per letter and 12 letters per lane; unused letters are 0
+class PackedKey {
+public:
+    UINT64 lane[3];
+};
+
+// entries of packed words, linked in PACKED_UNIT units; PACKED_LONG in the first lane marks a LongEntry
+class PackedLink {
+public:
+    DWORD next_unit;
+
+    INT64 Next() const { return next_unit == PACKED_UNIT_END ? CHAIN_END : (INT64)next_unit * PACKED_UNIT; }
+    void SetNext(INT64 off) { next_unit = off == CHAIN_END ? PACKED_UNIT_END : (DWORD)(off / PACKED_UNIT); }
+};
+
+class ShortEntry {
+public:
+    UINT64 key;
+    DWORD counter;
+    PackedLink link;
+};
+
+class LongEntry {
+public:
+    UINT64 key[3];
+    DWORD counter;
+    PackedLink link;
+};
+
 #pragma pack(push, 1)
 class HashHeader {
 public:
     UINT64 hash;
-    int next_offset;
+    INT64 next_offset;
 };
 #pragma pack(pop)
 
@@ -151,6 +341,63 @@ public:
         }
     }
     
+    DWORD Count() {
+        EnterCriticalSection(&cs);
+        DWORD n = Q->getSize();
+        LeaveCriticalSection(&cs);
+        return n;
+    }
+
+    // same as Consume, but returns 1 right away instead of blocking when the queue is empty
+    int TryConsume(void* element) {
+        DWORD waitResult = WaitForMultipleObjects(2, waitArray, FALSE, 0);
+        if (waitResult == WAIT_OBJECT_0) {
+            return -1; //eventQuit signaled
+        }
+        else if (waitResult == WAIT_TIMEOUT) {
+            return 1;
+        }
+        else if (waitResult != WAIT_OBJECT_0 + 1) {
+            printf("Failed to wait for semaFull with error code: %d", GetLastError());
+            exit(-1);
+        }
+        EnterCriticalSection(&cs);
+        Q->Pop(element);
+        LeaveCriticalSection(&cs);
+        if (!ReleaseSemaphore(semaEmpty, 1, NULL)) {
+            printf("Failed to release semaFull with error code: %d\n", GetLastError());
+        }
+        return 0;
+    }
+
+    // consumes from the first of n queues with an element, starting at first; 1 on timeout
+    static int ConsumeFirst(PC** queues, int n, int first, void* element, DWORD ms) {
+        HANDLE waits[NODES_MAX + 1];
+        waits[0] = queues[0]->eventQuit;
+        for (int i = 0; i < n; i++) {
+            waits[i + 1] = queues[(first + i) % n]->semaFull;
+        }
+        DWORD waitResult = WaitForMultipleObjects(n + 1, waits, FALSE, ms);
+        if (waitResult == WAIT_OBJECT_0) {
+            return -1; //eventQuit signaled
+        }
+        else if (waitResult == WAIT_TIMEOUT) {
+            return 1;
+        }
+        else if (waitResult > WAIT_OBJECT_0 + n) {
+            printf("Failed to wait for semaFull with error code: %d", GetLastError());
+            exit(-1);
+        }
+        PC* q = queues[(first + waitResult - WAIT_OBJECT_0 - 1) % n];
+        EnterCriticalSection(&q->cs);
+        q->Q->Pop(element);
+        LeaveCriticalSection(&q->cs);
+        if (!ReleaseSemaphore(q->semaEmpty, 1, NULL)) {
+            printf("Failed to release semaFull with error code: %d\n", GetLastError());
+        }
+        return 0;
+    }
+
     int Consume(void* element) {
         DWORD waitResult = WaitForMultipleObjects(2, waitArray, FALSE, INFINITE);
         if (waitResult == WAIT_OBJECT_0) {
@@ -176,597 +423,5364 @@ LONGLONG getTime() {
     return time.QuadPart;
 }
 
-char* formatNumber_DWORD(DWORD d) {
-    if (d == 0) {
-        char* cstr = new char[2];
-        cstr[0] = '0';
-        cstr[1] = '\0';
-        return cstr;
-    }
-
-    std::string ret = "";
-    int count = 0;
-
-    while (d > 0) {
-        if (count != 0 && count % 3 == 0) {
-            ret += ',';
+// Writes d with commas between groups of three digits and returns the end of it.
+inline char* PutNumber(char* out, UINT64 d) {
+    char digits[32];
+    int n = 0;
+    do {
+        if (n % 4 == 3) {
+            digits[n++] = ',';
         }
-        ret += (d % 10) + '0';
+        digits[n++] = '0' + d % 10;
         d /= 10;
-        count++;
+    } while (d > 0);
+    while (n > 0) {
+        *out++ = digits[--n];
     }
+    return out;
+}
 
-    std::string temp = "";
+// Runs f(i) for every i below n, each on a thread of its own, and returns once all are done.
+template <typename F>
+class ThreadTask {
+public:
+    F* f;
+    int i;
 
-    for (int i = ret.size() - 1; i >= 0; i--) {
-        temp += ret[i];
+    static DWORD WINAPI Run(LPVOID p) {
+        ThreadTask* t = (ThreadTask*)p;
+        (*t->f)(t->i);
+        return 0;
     }
+};
 
-    char* cstr = new char[temp.size() + 1];
-    memcpy(cstr, temp.c_str(), temp.size() + 1);
-
-    return cstr;
+template <typename F>
+void RunThreads(int n, F f) {
+    ThreadTask<F>* tasks = new ThreadTask<F>[n];
+    HANDLE* handles = new HANDLE[n];
+    for (int i = 0; i < n; i++) {
+        tasks[i].f = &f;
+        tasks[i].i = i;
+        if ((handles[i] = CreateThread(NULL, 0, ThreadTask<F>::Run, &tasks[i], 0, NULL)) == NULL) {
+            printf("(-) Error %d creating thread.", GetLastError());
+            exit(-1);
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        WaitForSingleObject(handles[i], INFINITE);
+        CloseHandle(handles[i]);
+    }
+    delete[] handles;
+    delete[] tasks;
 }
 
-char* formatNumber(UINT64 d) {
-    if (d == 0) {
-        char* cstr = new char[2];
-        cstr[0] = '0';
-        cstr[1] = '\0';
-        return cstr;
-    }
+// word index header, followed by block offsets, rank positions and the front-coded dictionary
+class IndexHeader {
+public:
+    char magic[8]; // INDEX_MAGIC
+    UINT64 words;
+    UINT64 total; // sum of the counts
+    UINT64 blocks;
+    UINT64 blockOffset; // file offsets of the parts that follow
+    UINT64 rankOffset;
+    UINT64 dictOffset;
+    UINT64 size; // of the whole file
+};
 
-    std::string ret = "";
-    int count = 0;
+inline char* PutVarint(char* out, UINT64 v) {
+    while (v >= 0x80) {
+        *out++ = (char)(v | 0x80);
+        v >>= 7;
+    }
+    *out++ = (char)v;
+    return out;
+}
 
-    while (d > 0) {
-        if (count != 0 && count % 3 == 0) {
-            ret += ',';
+// nullptr when the varint runs past end or past 64 bits
+inline const UCHAR* GetVarint(const UCHAR* in, const UCHAR* end, UINT64* v) {
+    UINT64 x = 0;
+    for (int shift = 0; in < end && shift < 64; shift += 7) {
+        x |= (UINT64)(*in & 0x7F) << shift;
+        if ((*in++ & 0x80) == 0) {
+            *v = x;
+            return in;
         }
-        ret += (d % 10) + '0';
-        d /= 10;
-        count++;
     }
+    return nullptr;
+}
 
-    std::string temp = "";
-
-    for (int i = ret.size() - 1; i >= 0; i--) {
-        temp += ret[i];
+// writes the words of a listing, given in rank order, as a word index in byte order
+void SaveIndex(const char* name, const WordEntry* entries, int n, int threads) {
+    const int nGroups = 1 << 16;
+    auto groupOf = [&](UINT32 i) {
+        const UCHAR* w = (const UCHAR*)entries[i].wordPointer;
+        return w[0] == 0 ? 0 : w[0] << 8 | w[1];
+    };
+    std::vector<int> groupStart(nGroups + 1, 0);
+    for (int i = 0; i < n; i++) {
+        groupStart[groupOf(i) + 1]++;
     }
+    for (int g = 0; g < nGroups; g++) {
+        groupStart[g + 1] += groupStart[g];
+    }
+    std::vector<int> next(groupStart.begin(), groupStart.end() - 1);
+    std::vector<UINT32> byWord(n);
+    for (int i = 0; i < n; i++) {
+        byWord[next[groupOf(i)]++] = i;
+    }
+    std::vector<int> order;
+    for (int g = 0; g < nGroups; g++) {
+        if (groupStart[g + 1] - groupStart[g] > 1) {
+            order.push_back(g);
+        }
+    }
+    std::sort(order.begin(), order.end(), [&](int a, int b) {
+        return groupStart[a + 1] - groupStart[a] > groupStart[b + 1] - groupStart[b];
+    });
+    volatile LONG nextGroup = 0;
+    RunThreads(threads, [&](int t) {
+        for (LONG k; (k = InterlockedIncrement(&nextGroup) - 1) < (LONG)order.size(); ) {
+            std::sort(byWord.begin() + groupStart[order[k]], byWord.begin() + groupStart[order[k] + 1],
+                [&](UINT32 a, UINT32 b) { return strcmp(entries[a].wordPointer, entries[b].wordPointer) < 0; });
+        }
+    });
+
+    IndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.words = n;
+    header.blocks = (n + INDEX_BLOCK - 1) / INDEX_BLOCK;
+    std::vector<UINT64> blockOffsets(header.blocks);
+    std::vector<UINT32> rankView(n);
+    std::vector<char> dict;
+    const char* prev = "";
+    for (int d = 0; d < n; d++) {
+        const WordEntry& e = entries[byWord[d]];
+        size_t len = strlen(e.wordPointer);
+        size_t shared = 0;
+        if (d % INDEX_BLOCK == 0) {
+            blockOffsets[d / INDEX_BLOCK] = dict.size();
+        }
+        else {
+            while (shared < len && prev[shared] == e.wordPointer[shared]) {
+                shared++;
+            }
+        }
+        size_t at = dict.size();
+        dict.resize(at + len + 40);
+        char* out = PutVarint(dict.data() + at, shared);
+        out = PutVarint(out, len - shared);
+        memcpy(out, e.wordPointer + shared, len - shared);
+        out = PutVarint(out + len - shared, e.counter);
+        out = PutVarint(out, byWord[d]);
+        dict.resize(out - dict.data());
+        rankView[byWord[d]] = d;
+        header.total += e.counter;
+        prev = e.wordPointer;
+    }
+    header.blockOffset = sizeof(header);
+    header.rankOffset = header.blockOffset + header.blocks * sizeof(UINT64);
+    header.dictOffset = header.rankOffset + (UINT64)n * sizeof(UINT32);
+    header.size = header.dictOffset + dict.size();
 
-    char* cstr = new char[temp.size() + 1];
-    memcpy(cstr, temp.c_str(), temp.size() + 1);
-
-    return cstr;
+    FILE* file = fopen(name, "wb");
+    if (file == nullptr) {
+        perror("Error opening file");
+        exit(-1);
+    }
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(blockOffsets.data(), sizeof(UINT64), blockOffsets.size(), file);
+    fwrite(rankView.data(), sizeof(UINT32), rankView.size(), file);
+    fwrite(dict.data(), 1, dict.size(), file);
+    fclose(file);
 }
 
-class HashTable {
+// a word index mapped read-only; lookups bisect the block offsets and decode one block
+class WordIndex {
 public:
-    int* hash;
-    char* mainHashBuf;
-
-    UINT64 offset;
-    UINT64 capacity;
-
-    int nBins;
-    int size;
-
-    int upperToLower[256];
-
-    UINT64 max_depth = 0;
-    UINT64 lookup_total = 0;
-    UINT64 searches = 0;
-
-    HashTable(int nB) {
-        nBins = nB;
-        size = 0;
-
-        hash = (int*)malloc(nBins * sizeof(int));
-        memset(hash, -1, nBins * sizeof(int));
-
-        mainHashBuf = (char*)VirtualAlloc(NULL, (UINT64) 1 << 40, MEM_RESERVE, PAGE_READWRITE);
-        mainHashBuf = (char*)VirtualAlloc(mainHashBuf, (UINT64) 1 << 20, MEM_COMMIT, PAGE_READWRITE);
-
-        offset = 0;
-        capacity = 1 << 20;
-
-        for (int i = 0; i < 256; ++i) {
-            upperToLower[i] = 0;
+    const IndexHeader* header;
+    const UINT64* blockOffsets;
+    const UINT32* rankView;
+    const UCHAR* dict;
+    const UCHAR* dictEnd;
+
+    bool Open(const char* name) {
+        HANDLE hFile = CreateFile(name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hFile == INVALID_HANDLE_VALUE) {
+            printf("CreateFile error: %d\n", GetLastError());
+            return false;
         }
-
-        for (char c = 'a'; c <= 'z'; ++c) {
-            upperToLower[c] = c;
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(hFile, &size) || size.QuadPart < sizeof(IndexHeader)) {
+            printf("%s is not a word index\n", name);
+            CloseHandle(hFile);
+            return false;
+        }
+        HANDLE hMap = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (hMap == NULL) {
+            printf("CreateFileMapping error: %d\n", GetLastError());
+            CloseHandle(hFile);
+            return false;
+        }
+        const char* base = (const char*)MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
+        // the view keeps the mapping and the file alive
+        CloseHandle(hMap);
+        CloseHandle(hFile);
+        if (base == NULL) {
+            printf("MapViewOfFile error: %d\n", GetLastError());
+            return false;
         }
 
-        for (char c = 'A'; c <= 'Z'; ++c) {
-            upperToLower[c] = c + 32;
+        // every part must lie inside the file, in order, before anything indexes into it
+        const IndexHeader* h = (const IndexHeader*)base;
+        UINT64 bytes = (UINT64)size.QuadPart;
+        if (memcmp(h->magic, INDEX_MAGIC, sizeof(h->magic)) != 0 || h->size != bytes || h->words > bytes ||
+            h->blocks != (h->words + INDEX_BLOCK - 1) / INDEX_BLOCK || h->blockOffset < sizeof(IndexHeader) ||
+            h->blockOffset > bytes || h->blockOffset + h->blocks * sizeof(UINT64) > h->rankOffset ||
+            h->rankOffset > bytes || h->rankOffset + h->words * sizeof(UINT32) > h->dictOffset || h->dictOffset > bytes) {
+            printf("%s is not a word index\n", name);
+            UnmapViewOfFile(base);
+            return false;
         }
+        header = h;
+        blockOffsets = (const UINT64*)(base + h->blockOffset);
+        rankView = (const UINT32*)(base + h->rankOffset);
+        dict = (const UCHAR*)(base + h->dictOffset);
+        dictEnd = (const UCHAR*)(base + bytes);
+        return true;
     }
 
-    HashValue* FindInsertKey(UINT64 hashKey, int valueSize, bool& found) {
-        DWORD hash_slot = hashKey & (nBins - 1);
-        lookup_total++;
-        searches++;
-        int temp_searches = 1;
-
-        //if hash offset is -1, instantiate to current offset and create hash entry
-        if (hash[hash_slot] == -1) {
-            hash[hash_slot] = offset;
-
-            if (offset + sizeof(HashHeader) + valueSize >= capacity) {
-                VirtualAlloc(mainHashBuf + capacity, (UINT64) 1 << 20, MEM_COMMIT, PAGE_READWRITE);
-                capacity += 1 << 20;
+    // word is compared byte for byte with the words of the index
+    bool Find(const char* word, DWORD* count, UINT64* rank) {
+        // the first block that starts after word; word can only be in the one before it
+        UINT64 lo = 0, hi = header->blocks;
+        char at[INDEX_WORD_MAX];
+        UINT64 c, r;
+        while (lo < hi) {
+            UINT64 mid = (lo + hi) / 2;
+            if (ReadEntry(Block(mid), at, &c, &r) == nullptr) {
+                return false;
+            }
+            if (strcmp(at, word) <= 0) {
+                lo = mid + 1;
+            }
+            else {
+                hi = mid;
             }
-
-            HashHeader* curr_hH = (HashHeader*) (mainHashBuf + offset);
-            curr_hH->hash = hashKey;
-            curr_hH->next_offset = -1;
-            found = false;
-
-            offset += sizeof(HashHeader) + valueSize;
-            size++;
-
-            return (HashValue*)(curr_hH + 1);
         }
-
-        else {
-            //if hash offset != -1, iterate through collision chain until word is found
-            HashHeader* curr_hH = (HashHeader*) (mainHashBuf + hash[hash_slot]);
-            HashValue* curr_hV = (HashValue*) (curr_hH + 1);
-            while(curr_hH->next_offset != -1) {
-                searches++;
-                temp_searches++;
-                if (temp_searches > max_depth) {
-                    max_depth = temp_searches;
-                }
-                if (hashKey == curr_hH->hash) {
-                    found = true;
-                    return curr_hV;
-                }
-                else {
-                    curr_hH = (HashHeader*) (mainHashBuf + curr_hH->next_offset);
-                    curr_hV = (HashValue*) (curr_hH + 1);
-                }
+        if (lo == 0) {
+            return false;
+        }
+        const UCHAR* p = Block(lo - 1);
+        UINT64 inBlock = header->words - (lo - 1) * INDEX_BLOCK;
+        for (UINT64 i = 0; i < INDEX_BLOCK && i < inBlock; i++) {
+            if ((p = ReadEntry(p, at, &c, &r)) == nullptr) {
+                return false;
             }
-            if (hashKey == curr_hH->hash) {
-                found = true;
-                return curr_hV;
+            int cmp = strcmp(at, word);
+            if (cmp == 0) {
+                *count = (DWORD)c;
+                *rank = r;
+                return true;
             }
-            else { //if next pointer is -1 and word doesnt equal
-                if (offset + sizeof(HashHeader) + valueSize >= capacity) {
-                    VirtualAlloc(mainHashBuf + capacity, (UINT64)1 << 20, MEM_COMMIT, PAGE_READWRITE);
-                    capacity += 1 << 20;
-                }
-
-                curr_hH->next_offset = offset;
+            if (cmp > 0) {
+                break;
+            }
+        }
+        return false;
+    }
 
-                HashHeader* new_hH = (HashHeader*) (mainHashBuf + offset);
-                new_hH->hash = hashKey;
-                new_hH->next_offset = -1;
-                found = false;
-                size++;
+    bool At(UINT64 rank, char* word, DWORD* count) {
+        if (rank >= header->words) {
+            return false;
+        }
+        UINT64 d = rankView[rank];
+        if (d >= header->words) {
+            return false;
+        }
+        const UCHAR* p = Block(d / INDEX_BLOCK);
+        UINT64 c, r;
+        for (UINT64 i = d / INDEX_BLOCK * INDEX_BLOCK; i <= d; i++) {
+            if ((p = ReadEntry(p, word, &c, &r)) == nullptr) {
+                return false;
+            }
+        }
+        *count = (DWORD)c;
+        return true;
+    }
 
-                offset += sizeof(HashHeader) + valueSize;
+private:
+    // start of block b, nullptr when its offset is outside the dictionary
+    const UCHAR* Block(UINT64 b) {
+        return blockOffsets[b] < (UINT64)(dictEnd - dict) ? dict + blockOffsets[b] : nullptr;
+    }
 
-                return (HashValue*)(new_hH + 1);
-            }
+    // decodes the entry at p onto the previous word; nullptr when it overruns the dictionary or buffer
+    const UCHAR* ReadEntry(const UCHAR* p, char* word, UINT64* count, UINT64* rank) {
+        UINT64 shared, len;
+        if (p == nullptr || (p = GetVarint(p, dictEnd, &shared)) == nullptr || (p = GetVarint(p, dictEnd, &len)) == nullptr ||
+            shared >= INDEX_WORD_MAX || len >= INDEX_WORD_MAX - shared || len > (UINT64)(dictEnd - p)) {
+            return nullptr;
         }
+        memcpy(word + shared, p, len);
+        word[shared + len] = '\0';
+        if ((p = GetVarint(p + len, dictEnd, count)) == nullptr) {
+            return nullptr;
+        }
+        return GetVarint(p, dictEnd, rank);
     }
+};
 
-    void PrintContents(FILE* file) {
-        WordEntry* printBuf = new WordEntry[size];
-        int printBufIndex = 0;
+// writes the word listing from per-thread buffers, optionally split by rank into parts
+class ReportWriter {
+public:
+    FILE* file;
+    int threads;
+    int parts;
+    int top; // words listed, 0 lists every word
+    char* saveName; // word index of the listed words, optional
 
-        for (int i = 0; i < nBins; i++) {
-            if (hash[i] != -1) {
-                HashHeader* curr_hH = (HashHeader*)(mainHashBuf + hash[i]);
-                HashValue* curr_hV = (HashValue*)(curr_hH + 1);
-                while (curr_hH->next_offset != -1) {
-                    printBuf[printBufIndex].counter = curr_hV->counter;
-                    printBuf[printBufIndex++].wordPointer = curr_hV->GetWordPtr();
+    ReportWriter(FILE* file, int threads, int parts, int top, char* saveName) : file(file), threads(threads), parts(parts), top(top), saveName(saveName) {}
 
-                    curr_hH = (HashHeader*)(mainHashBuf + curr_hH->next_offset);
-                    curr_hV = (HashValue*)(curr_hH + 1);
-                }
-                printBuf[printBufIndex].counter = curr_hV->counter;
-                printBuf[printBufIndex++].wordPointer = curr_hV->GetWordPtr();
-            }
+    // entries and errors (if any) are in rank order
+    void Write(const WordEntry* entries, const DWORD* errors, int n) {
+        if (saveName != nullptr) {
+            SaveIndex(saveName, entries, n, threads);
         }
-
-        for (int i = 0; i < size; i++) {
-            toLower(printBuf[i].wordPointer);
+        if (parts > 1) {
+            WriteParts(entries, errors, n);
+            return;
+        }
+        std::vector<std::vector<char>> buf(threads);
+        std::vector<size_t> used(threads);
+        for (int first = 0; first < n; first += threads * REPORT_LINES) {
+            RunThreads(threads, [&](int t) {
+                int from = first + t * REPORT_LINES < n ? first + t * REPORT_LINES : n;
+                int to = from + REPORT_LINES < n ? from + REPORT_LINES : n;
+                used[t] = Format(buf[t], entries, errors, from, to);
+            });
+            for (int t = 0; t < threads; t++) {
+                fwrite(buf[t].data(), 1, used[t], file);
+            }
         }
+    }
 
-        std::sort(printBuf, printBuf + size);
+private:
+    void WriteParts(const WordEntry* entries, const DWORD* errors, int n) {
+        volatile LONG nextPart = 0;
+        RunThreads(threads < parts ? threads : parts, [&](int t) {
+            std::vector<char> buf;
+            for (LONG p; (p = InterlockedIncrement(&nextPart) - 1) < parts; ) {
+                char name[32];
+                _snprintf(name, sizeof(name), "report-%d.txt", p + 1);
+                FILE* part = fopen(name, "w");
+                if (part == nullptr) {
+                    perror("Error opening file");
+                    exit(-1);
+                }
+                int to = (int)((INT64)n * (p + 1) / parts);
+                for (int i = (int)((INT64)n * p / parts); i < to; i += REPORT_LINES) {
+                    size_t used = Format(buf, entries, errors, i, i + REPORT_LINES < to ? i + REPORT_LINES : to);
+                    fwrite(buf.data(), 1, used, part);
+                }
+                fclose(part);
+            }
+        });
+    }
 
-        for (int i = 0; i < size; i++) {
-            fprintf(file, "[%s] %s = %s\n", formatNumber(i),  printBuf[i].wordPointer, formatNumber_DWORD(printBuf[i].counter));
-            //fprintf(file, "%s\n", formatNumber_DWORD(printBuf[i].counter));
+    // Formats lines from up to to into buf, which only grows, and returns the bytes used.
+    static size_t Format(std::vector<char>& buf, const WordEntry* entries, const DWORD* errors, int from, int to) {
+        size_t used = 0;
+        for (int i = from; i < to; i++) {
+            const char* word = entries[i].wordPointer;
+            size_t len = strlen(word);
+            if (buf.size() < used + len + REPORT_LINE_EXTRA) {
+                buf.resize(2 * (used + len + REPORT_LINE_EXTRA));
+            }
+            char* out = buf.data() + used;
+            *out++ = '[';
+            out = PutNumber(out, i);
+            memcpy(out, "] ", 2);
+            memcpy(out + 2, word, len);
+            memcpy(out + 2 + len, " = ", 3);
+            out = PutNumber(out + 5 + len, entries[i].counter);
+            if (errors != nullptr && errors[i] != 0) {
+                memcpy(out, " (error ", 8);
+                out = PutNumber(out + 8, errors[i]);
+                *out++ = ')';
+            }
+            *out++ = '\n';
+            used = out - buf.data();
         }
+        return used;
+    }
+};
 
-        delete[] printBuf;
+// packs the low 5 bits of each letter, loaded 8 bytes at a time, into key
+void PackWord(const char* word, DWORD len, PackedKey* key) {
+    UINT64 group[4] = { 0, 0, 0, 0 };
+    DWORD full = len >> 3;
+    DWORD rest = len & 7;
+    for (DWORD i = 0; i < full; i++) {
+        group[i] = *(UINT64*)(word + 8 * i);
+    }
+    if (rest != 0) {
+        group[full] = *(UINT64*)(word + len - 8) >> (64 - 8 * rest);
+    }
+    for (int i = 0; i < 4; i++) {
+        UINT64 v = group[i] & 0x1F1F1F1F1F1F1F1FULL;
+        v = (v & 0x001F001F001F001FULL) | (v >> 3 & 0x03E003E003E003E0ULL);
+        v = (v & 0x000003FF000003FFULL) | (v >> 6 & 0x000FFC00000FFC00ULL);
+        group[i] = (v & 0x00000000000FFFFFULL) | (v >> 12 & 0x000000FFFFF00000ULL);
     }
+    key->lane[0] = group[0] | (group[1] & 0xFFFFF) << 40;
+    key->lane[1] = group[1] >> 20 | group[2] << 20;
+    key->lane[2] = group[3];
+    if (len > PACKED_LANE) {
+        key->lane[0] |= PACKED_LONG;
+    }
+}
 
-    void toLower(char* cstr) {
-        int i = 0;
-        while(cstr[i] != '\0') {
-            cstr[i] = upperToLower[cstr[i]];
-            i++;
+DWORD UnpackWord(const PackedKey* key, char* out) {
+    DWORD len = 0;
+    while (len < 31) {
+        UINT64 code = key->lane[len / PACKED_LANE] >> (5 * (len % PACKED_LANE)) & 0x1F;
+        if (code == 0) {
+            break;
         }
+        out[len++] = (char)('a' + code - 1);
     }
+    out[len] = '\0';
+    return len;
+}
 
-    void tallyWordLengths() {
-        DWORD* countBuf = new DWORD[31];
-        memset(countBuf, 0, sizeof(DWORD) * 31);
-        int printBufIndex = 0;
+UINT64 PackedHash(const PackedKey& key) {
+    UINT64 hi;
+    UINT64 lo = _umul128(key.lane[0] ^ 0x9E3779B97F4A7C15ULL, (key.lane[1] + key.lane[2] * 0xC2B2AE3D27D4EB4FULL) ^ 0x165667B19E3779F9ULL, &hi);
+    return lo ^ hi;
+}
 
-        for (int i = 0; i < nBins; i++) {
-            if (hash[i] != -1) {
-                HashHeader* curr_hH = (HashHeader*)(mainHashBuf + hash[i]);
-                HashValue* curr_hV = (HashValue*)(curr_hH + 1);
-                while (curr_hH->next_offset != -1) {
-                    countBuf[strlen(curr_hV->GetWordPtr())]++;
+// the NUMA nodes with processors; worker i goes to node i % nNodes
+class NumaLayout {
+public:
+    int nNodes;
+    USHORT node[NODES_MAX]; // node numbers, leaving out nodes that only have memory
+    GROUP_AFFINITY mask[NODES_MAX];
+
+    NumaLayout() {
+        nNodes = 1;
+        node[0] = 0;
+        memset(mask, 0, sizeof(mask));
+    }
 
-                    curr_hH = (HashHeader*)(mainHashBuf + curr_hH->next_offset);
-                    curr_hV = (HashValue*)(curr_hH + 1);
-                }
-                countBuf[strlen(curr_hV->GetWordPtr())]++;
+    void Load() {
+        ULONG highest;
+        if (!GetNumaHighestNodeNumber(&highest)) {
+            return;
+        }
+        int n = 0;
+        for (ULONG i = 0; i <= highest && n < NODES_MAX; i++) {
+            GROUP_AFFINITY a;
+            if (GetNumaNodeProcessorMaskEx((USHORT)i, &a) && a.Mask != 0) {
+                node[n] = (USHORT)i;
+                mask[n] = a;
+                n++;
             }
         }
+        if (n > 0) {
+            nNodes = n;
+        }
+    }
 
-        for (int i = 3; i <= 31; i++) {
-            printf("%lu\n", countBuf[i]);
+    // Pins the calling thread to a processor for worker w and returns its node's place in node[].
+    int PlaceWorker(int w) {
+        int n = w % nNodes;
+        int count = 0;
+        for (UINT64 m = mask[n].Mask; m != 0; m &= m - 1) {
+            count++;
         }
+        UINT64 m = mask[n].Mask;
+        for (int i = (w / nNodes) % count; i > 0; i--) {
+            m &= m - 1;
+        }
+        GROUP_AFFINITY one;
+        memset(&one, 0, sizeof(one));
+        one.Group = mask[n].Group;
+        one.Mask = m & (~m + 1);
+        SetThreadGroupAffinity(GetCurrentThread(), &one, NULL);
+        return n;
+    }
+
+    USHORT CurrentNode() {
+        PROCESSOR_NUMBER pn;
+        GetCurrentProcessorNumberEx(&pn);
+        USHORT n = 0;
+        GetNumaProcessorNodeEx(&pn, &n);
+        return n;
     }
 };
 
-class MainThreadClass {
+NumaLayout numa;
+
+// memory of the word tables, in large pages when allowed and pooled by size and node; arenas are reserved ranges
+class PagePool {
 public:
-    HANDLE terminateEvent;
-    HANDLE timerEvent;
+    SIZE_T largePage; // 0 while large pages are off
+    bool perNode;
+    UINT64 arenaSpan; // address space of one word arena
     CRITICAL_SECTION cs;
-    CPU cpu;
-    MersenneTwister mt;
+    std::unordered_map<UINT64, std::vector<void*>> freeBlocks; // by size, plus the node under perNode
+    std::unordered_map<void*, USHORT> blockNode;
+    std::vector<std::pair<char*, UINT64>> freeArenas; // with the bytes committed at their start
+
+    PagePool() {
+        largePage = 0;
+        perNode = false;
+        arenaSpan = ARENA_SPAN;
+        InitializeCriticalSection(&cs);
+    }
 
-    PC* pcEmpty;
-    PC* pcFull;
+    // large pages need the lock-memory privilege enabled in the process token
+    void EnableLargePages() {
+        HANDLE token;
+        if (GetLargePageMinimum() == 0 || !OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token)) {
+            return;
+        }
+        TOKEN_PRIVILEGES tp;
+        tp.PrivilegeCount = 1;
+        tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+        if (LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME, &tp.Privileges[0].Luid) &&
+            AdjustTokenPrivileges(token, FALSE, &tp, 0, NULL, NULL) && GetLastError() == ERROR_SUCCESS) {
+            largePage = GetLargePageMinimum();
+        }
+        CloseHandle(token);
+    }
 
-    UINT64 fileSize;
-    DWORD lenLongestWord = 32;
-    DWORD nSlots = 0;
-    int slotSize = 0;
-    DWORD B = 0;
-    int shadowSize = 0;
-    int padding = 0;
+    UINT64 Round(UINT64 bytes) {
+        UINT64 page = largePage != 0 && bytes >= largePage ? largePage : SMALL_PAGE;
+        return (bytes + page - 1) & ~(page - 1);
+    }
 
-    char* mega_buf;
-    char* filename;
+    // a committed block of at least bytes; new blocks are zeroed, pooled ones are not
+    void* Alloc(UINT64 bytes) {
+        bytes = Round(bytes);
+        USHORT node = perNode ? numa.CurrentNode() : 0;
+        EnterCriticalSection(&cs);
+        std::vector<void*>& pooled = freeBlocks[bytes | node]; // sizes are whole pages, the node fits below
+        if (!pooled.empty()) {
+            void* p = pooled.back();
+            pooled.pop_back();
+            LeaveCriticalSection(&cs);
+            return p;
+        }
+        LeaveCriticalSection(&cs);
 
-    FILE* file;
+        void* p = NULL;
+        if (largePage != 0 && bytes >= largePage) {
+            p = VirtualAllocExNuma(GetCurrentProcess(), NULL, bytes, MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES, PAGE_READWRITE, perNode ? node : NUMA_NO_PREFERRED_NODE);
+        }
+        if (p == NULL) {
+            // physical memory may be too fragmented for large pages
+            p = VirtualAllocExNuma(GetCurrentProcess(), NULL, bytes, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE, perNode ? node : NUMA_NO_PREFERRED_NODE);
+        }
+        if (p == NULL) {
+            printf("VirtualAlloc error: %d\n", GetLastError());
+            exit(-1);
+        }
+        if (perNode) {
+            EnterCriticalSection(&cs);
+            blockNode[p] = node;
+            LeaveCriticalSection(&cs);
+        }
+        return p;
+    }
 
-    int activeThreads = 0;
-    UINT64 totalBytesRead = 0;
-    UINT64 totalMatches = 0;
+    // an arena, of the node of the caller under perNode, with committed bytes usable already
+    char* TakeArena(UINT64* committed) {
+        USHORT node = perNode ? numa.CurrentNode() : 0;
+        EnterCriticalSection(&cs);
+        for (size_t i = freeArenas.size(); i-- > 0; ) {
+            if (!perNode || blockNode[freeArenas[i].first] == node) {
+                char* p = freeArenas[i].first;
+                *committed = freeArenas[i].second;
+                freeArenas.erase(freeArenas.begin() + i);
+                LeaveCriticalSection(&cs);
+                return p;
+            }
+        }
+        LeaveCriticalSection(&cs);
 
-    UINT64 total_words = 0;
-    UINT64 unique_words = 0;
-    UINT64 invalid_words = 0;
+        char* p = (char*)VirtualAlloc(NULL, arenaSpan, MEM_RESERVE, PAGE_READWRITE);
+        if (p == NULL) {
+            printf("VirtualAlloc error: %d\n", GetLastError());
+            exit(-1);
+        }
+        if (perNode) {
+            EnterCriticalSection(&cs);
+            blockNode[p] = node;
+            LeaveCriticalSection(&cs);
+        }
+        *committed = 0;
+        return p;
+    }
 
-    UINT64 num_lookups;
-    UINT64 lookup_depth;
-    UINT64 max_lookup_depth;
+    // commits the pages of an arena from committed up to bytes
+    void GrowArena(char* arena, UINT64 committed, UINT64 bytes) {
+        if (bytes > arenaSpan) {
+            char n[32];
+            *PutNumber(n, committed) = '\0';
+            printf("Word arena full at %s bytes\n", n);
+            exit(-1);
+        }
+        if (VirtualAllocExNuma(GetCurrentProcess(), arena + committed, bytes - committed, MEM_COMMIT, PAGE_READWRITE, perNode ? numa.CurrentNode() : NUMA_NO_PREFERRED_NODE) == NULL) {
+            printf("VirtualAlloc error: %d\n", GetLastError());
+            exit(-1);
+        }
+    }
 
-    char isalphaLUT[256];
-    char isdelimiterLUT[256];
-    UINT64 sboxLUT[256];
+    void FreeArena(char* arena, UINT64 committed) {
+        if (arena == nullptr) {
+            return;
+        }
+        EnterCriticalSection(&cs);
+        freeArenas.push_back(std::make_pair(arena, committed));
+        LeaveCriticalSection(&cs);
+    }
 
-    HashTable* main_hT;
+    // bytes is the size the block was asked for with
+    void Free(void* p, UINT64 bytes) {
+        if (p == nullptr) {
+            return;
+        }
+        EnterCriticalSection(&cs);
+        freeBlocks[Round(bytes) | (perNode ? blockNode[p] : 0)].push_back(p);
+        LeaveCriticalSection(&cs);
+    }
+};
 
-    LONGLONG init_mergeTime;
-    LONGLONG final_mergeTime;
+PagePool tablePages;
 
-    int nB;
+// hash of a SwissTable key, needed again when the table grows
+typedef UINT64 (*SlotHashFn)(const UINT64* key);
 
-    MainThreadClass(int nBin, int buffer_size, char* fn, FILE* f) {
-        terminateEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
-        timerEvent = CreateEvent(NULL, TRUE, TRUE, NULL);
-        InitializeCriticalSection(&cs);
+UINT64 ShortKeyHash(const UINT64* key) {
+    PackedKey k = { { key[0], 0, 0 } };
+    return PackedHash(k);
+}
 
-        if (terminateEvent == NULL)
-        {
-            printf("CreateEvent error: %d\n", GetLastError());
-            exit(-1);
+UINT64 LongKeyHash(const UINT64* key) {
+    PackedKey k = { { key[0], key[1], key[2] } };
+    return PackedHash(k);
+}
+
+UINT64 StoredHash(const UINT64* key) {
+    return key[0]; // KEYS_HASH: the key is the word hash
+}
+
+// SwissTable-style open addressing; doubles at SWISS_MAX_LOAD eighths and moves a few groups per lookup
+template <int W, typename V>
+class SwissTable {
+public:
+    class Slot {
+    public:
+        UINT64 key[W];
+        DWORD counter;
+        V value; // offset of the word in mainHashBuf under KEYS_HASH
+    };
+
+    UCHAR* ctrl;
+    Slot* slots;
+    UINT64 nGroups; // a power of 2
+    UINT64 used; // keys in both the new and the old slots
+    SlotHashFn hashOf;
+
+    // the slots before the last doubling, while they still hold keys
+    UCHAR* oldCtrl;
+    Slot* oldSlots;
+    UINT64 oldGroups;
+    UINT64 migrated; // old groups moved so far
+
+    SwissTable(UINT64 capacity, SlotHashFn fn) {
+        hashOf = fn;
+        used = 0;
+        oldCtrl = nullptr;
+        oldSlots = nullptr;
+        Allocate(capacity > SWISS_GROUP ? capacity / SWISS_GROUP : 1);
+    }
+
+    void Allocate(UINT64 groups) {
+        nGroups = groups;
+        ctrl = (UCHAR*)tablePages.Alloc(groups * SWISS_GROUP);
+        slots = (Slot*)tablePages.Alloc(groups * SWISS_GROUP * sizeof(Slot));
+        memset(ctrl, SWISS_EMPTY, groups * SWISS_GROUP);
+    }
+
+    void Release() {
+        tablePages.Free(ctrl, nGroups * SWISS_GROUP);
+        tablePages.Free(slots, nGroups * SWISS_GROUP * sizeof(Slot));
+        if (oldCtrl != nullptr) {
+            tablePages.Free(oldCtrl, oldGroups * SWISS_GROUP);
+            tablePages.Free(oldSlots, oldGroups * SWISS_GROUP * sizeof(Slot));
         }
+    }
 
-        if (timerEvent == NULL)
-        {
-            printf("CreateEvent error: %d\n", GetLastError());
-            exit(-1);
+    // returns the slot of key, or with found false a new one with a count of 0; probes counts groups
+    Slot* FindInsert(const UINT64* key, UINT64 h, bool& found, UINT64* probes) {
+        if (oldCtrl != nullptr) {
+            Migrate(SWISS_MIGRATE);
+        }
+        else if ((used + 1) * 8 > nGroups * SWISS_GROUP * SWISS_MAX_LOAD) {
+            Grow();
+        }
+        UCHAR tag = (UCHAR)(h >> 57);
+        __m128i tags = _mm_set1_epi8((char)tag);
+        __m128i empties = _mm_set1_epi8((char)SWISS_EMPTY);
+        UINT64 g = h & (nGroups - 1);
+        for (UINT64 step = 1; ; step++) {
+            (*probes)++;
+            __m128i c = _mm_load_si128((const __m128i*)(ctrl + g * SWISS_GROUP));
+            DWORD match = _mm_movemask_epi8(_mm_cmpeq_epi8(c, tags));
+            unsigned long bit;
+            while (_BitScanForward(&bit, match)) {
+                Slot* s = &slots[g * SWISS_GROUP + bit];
+                if (SameKey(s->key, key)) {
+                    found = true;
+                    return s;
+                }
+                match &= match - 1;
+            }
+            DWORD empty = _mm_movemask_epi8(_mm_cmpeq_epi8(c, empties));
+            if (_BitScanForward(&bit, empty)) {
+                UINT64 i = g * SWISS_GROUP + bit;
+                Slot* old = oldCtrl != nullptr ? FindOld(key, h, tags, probes) : nullptr;
+                ctrl[i] = tag;
+                found = old != nullptr;
+                if (found) {
+                    slots[i] = *old;
+                    return &slots[i];
+                }
+                memcpy(slots[i].key, key, sizeof(slots[i].key));
+                slots[i].counter = 0;
+                used++;
+                return &slots[i];
+            }
+            g = (g + step) & (nGroups - 1);
         }
+    }
 
-        file = f;
-        filename = fn;
-        lenLongestWord = 32;
+    // Looks for key among the old slots and marks its slot moved when it is there.
+    Slot* FindOld(const UINT64* key, UINT64 h, __m128i tags, UINT64* probes) {
+        __m128i empties = _mm_set1_epi8((char)SWISS_EMPTY);
+        UINT64 g = h & (oldGroups - 1);
+        for (UINT64 step = 1; ; step++) {
+            (*probes)++;
+            __m128i c = _mm_load_si128((const __m128i*)(oldCtrl + g * SWISS_GROUP));
+            DWORD match = _mm_movemask_epi8(_mm_cmpeq_epi8(c, tags));
+            unsigned long bit;
+            while (_BitScanForward(&bit, match)) {
+                UINT64 i = g * SWISS_GROUP + bit;
+                if (SameKey(oldSlots[i].key, key)) {
+                    oldCtrl[i] = SWISS_MOVED;
+                    return &oldSlots[i];
+                }
+                match &= match - 1;
+            }
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(c, empties)) != 0) {
+                return nullptr;
+            }
+            g = (g + step) & (oldGroups - 1);
+        }
+    }
 
-        nSlots = cpu.cpus + 5; // num slots to maintain
-        pcEmpty = new PC(terminateEvent, nSlots, sizeof(int));
-        pcFull = new PC(terminateEvent, nSlots, sizeof(MyBuf));
+    // the control bytes and the first slots of the group a lookup of h starts at
+    void Prefetch(UINT64 h) {
+        UINT64 g = h & (nGroups - 1);
+        _mm_prefetch((const char*)(ctrl + g * SWISS_GROUP), _MM_HINT_T0);
+        _mm_prefetch((const char*)&slots[g * SWISS_GROUP], _MM_HINT_T0);
+    }
 
-        DWORD sectorSize = 0;
-        GetDiskFreeSpace(NULL, NULL, &sectorSize, NULL, NULL);
-        shadowSize = (lenLongestWord / sectorSize + 1) * sectorSize;
-        padding = shadowSize + sectorSize; // both shadow buffers
-        B = 1 << buffer_size; // 1MB in each slot
-        slotSize = B + padding; // full slot with padding
-        // VirtualAlloc guarantees page-aligned addresses, while the heap does not
-        mega_buf = (char*)VirtualAlloc(NULL, (UINT64)nSlots * slotSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    static bool SameKey(const UINT64* a, const UINT64* b) {
+        for (int i = 0; i < W; i++) {
+            if (a[i] != b[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
 
-        for (int i = 0; i < 256; ++i) {
-            isalphaLUT[i] = 0;
-            isdelimiterLUT[i] = 0;
+    void Grow() {
+        oldCtrl = ctrl;
+        oldSlots = slots;
+        oldGroups = nGroups;
+        migrated = 0;
+        Allocate(nGroups * 2);
+    }
+
+    // moves the next groups of old slots over, marking them SWISS_MOVED so probes go on past them
+    void Migrate(UINT64 groups) {
+        UINT64 end = migrated + groups < oldGroups ? migrated + groups : oldGroups;
+        for (; migrated < end; migrated++) {
+            for (UINT64 i = migrated * SWISS_GROUP; i < (migrated + 1) * SWISS_GROUP; i++) {
+                if (oldCtrl[i] & SWISS_EMPTY) {
+                    continue;
+                }
+                // a key is never in the old and the new slots at once, so only a free slot is looked for
+                UINT64 h = hashOf(oldSlots[i].key);
+                UINT64 g = h & (nGroups - 1);
+                unsigned long bit;
+                for (UINT64 step = 1; ; step++) {
+                    __m128i c = _mm_load_si128((const __m128i*)(ctrl + g * SWISS_GROUP));
+                    if (_BitScanForward(&bit, _mm_movemask_epi8(_mm_cmpeq_epi8(c, _mm_set1_epi8((char)SWISS_EMPTY))))) {
+                        break;
+                    }
+                    g = (g + step) & (nGroups - 1);
+                }
+                ctrl[g * SWISS_GROUP + bit] = oldCtrl[i];
+                slots[g * SWISS_GROUP + bit] = oldSlots[i];
+                oldCtrl[i] = SWISS_MOVED;
+            }
         }
-        
-        for (char c = 'a'; c <= 'z'; ++c) {
-            isalphaLUT[c] = 1;
+        if (migrated == oldGroups) {
+            tablePages.Free(oldCtrl, oldGroups * SWISS_GROUP);
+            tablePages.Free(oldSlots, oldGroups * SWISS_GROUP * sizeof(Slot));
+            oldCtrl = nullptr;
+            oldSlots = nullptr;
         }
-        
-        for (char c = 'A'; c <= 'Z'; ++c) {
-            isalphaLUT[c] = 1;
+    }
+
+    template <typename F>
+    void ForEach(F f) {
+        for (UINT64 i = 0; i < nGroups * SWISS_GROUP; i++) {
+            if (!(ctrl[i] & SWISS_EMPTY)) {
+                f(&slots[i]);
+            }
+        }
+        if (oldCtrl != nullptr) {
+            for (UINT64 i = migrated * SWISS_GROUP; i < oldGroups * SWISS_GROUP; i++) {
+                if (!(oldCtrl[i] & SWISS_EMPTY)) {
+                    f(&oldSlots[i]);
+                }
+            }
+        }
+    }
+};
+
+// hash of a chained or shared entry, which picks its bin or slot
+UINT64 PackedEntryHash(const char* e) {
+    PackedKey key = { { *(UINT64*)e, 0, 0 } };
+    if (key.lane[0] & PACKED_LONG) {
+        memcpy(key.lane, ((LongEntry*)e)->key, sizeof(key.lane));
+    }
+    return PackedHash(key);
+}
+
+UINT64 HeaderEntryHash(const char* e) {
+    return ((HashHeader*)e)->hash;
+}
+
+typedef UINT64 (*EntryHashFn)(const char* e);
+
+// a worker's share of the arena of a SharedTable
+class SharedCursor {
+public:
+    char* at;
+    char* end;
+};
+
+// one table for all workers; slots hold an entry address and hash bits, are claimed by CAS and doubled under lock
+class SharedTable {
+public:
+    volatile LONG64* slots;
+    UINT64 nSlots; // a power of 2
+    volatile LONG64 used;
+    EntryHashFn hashOf;
+    SRWLOCK lock;
+
+    SharedTable(UINT64 capacity, EntryHashFn fn) {
+        hashOf = fn;
+        used = 0;
+        InitializeSRWLock(&lock);
+        nSlots = capacity;
+        slots = AllocSlots(nSlots);
+    }
+
+    static volatile LONG64* AllocSlots(UINT64 n) {
+        volatile LONG64* p = (volatile LONG64*)tablePages.Alloc(n * sizeof(LONG64));
+        memset((void*)p, 0, n * sizeof(LONG64));
+        return p;
+    }
+
+    // size bytes of the worker's arena; a LongEntry is aligned to its size, the rest to 16 bytes
+    char* Alloc(SharedCursor* cur, UINT64 size) {
+        UINT64 align = size == sizeof(LongEntry) ? sizeof(LongEntry) : 16;
+        char* p = (char*)(((UINT64)cur->at + align - 1) & ~(align - 1));
+        if (cur->at == nullptr || p + size > cur->end) {
+            // entries are found through the slots, so the chunks need not be contiguous
+            p = (char*)tablePages.Alloc(SHARED_ARENA_CHUNK);
+            cur->end = p + SHARED_ARENA_CHUNK;
         }
+        cur->at = p + size;
+        return p;
+    }
 
-        isdelimiterLUT['\0'] = 1;
-        isdelimiterLUT[' '] = 1;
-        isdelimiterLUT[','] = 1;
-        isdelimiterLUT['\n'] = 1;
-        isdelimiterLUT['\r'] = 1; 
-        isdelimiterLUT['.'] = 1;
-        isdelimiterLUT['\''] = 1;
-        isdelimiterLUT['"'] = 1;
-        isdelimiterLUT['?'] = 1;
-        isdelimiterLUT['-'] = 1;
-        isdelimiterLUT[':'] = 1;
-        isdelimiterLUT[';'] = 1;
-        isdelimiterLUT['*'] = 1;
-        isdelimiterLUT['!'] = 1;
-        isdelimiterLUT['\t'] = 1;
+    // returns the entry same() accepts, or with found false a new one made by init; caller holds lock shared
+    template <typename Same, typename Init>
+    char* FindInsert(UINT64 h, UINT64 size, SharedCursor* cur, Same same, Init init, bool& found, UINT64* probes) {
+        char* mine = nullptr;
+        for (;;) {
+            UINT64 mask = nSlots - 1;
+            for (UINT64 i = h & mask; ; i = (i + 1) & mask) {
+                (*probes)++;
+                LONG64 v = slots[i];
+                if (v == 0) {
+                    if ((UINT64)(used + 1) * 2 > nSlots) {
+                        Grow(mask + 1);
+                        break;
+                    }
+                    if (mine == nullptr) {
+                        mine = Alloc(cur, size);
+                        init(mine);
+                    }
+                    LONG64 slot = (LONG64)((h & SHARED_TAG) | (UINT64)mine);
+                    v = InterlockedCompareExchange64(&slots[i], slot, 0);
+                    if (v == 0) {
+                        InterlockedIncrement64(&used);
+                        found = false;
+                        return mine;
+                    }
+                }
+                char* e = (char*)(v & ~SHARED_TAG);
+                if (((UINT64)v & SHARED_TAG) == (h & SHARED_TAG) && same(e)) {
+                    if (mine != nullptr) {
+                        cur->at = mine; // nobody has seen it
+                    }
+                    found = true;
+                    return e;
+                }
+            }
+        }
+    }
 
-        for (int i = 0; i < 256; i++) {
-            sboxLUT[i] = mt.genrand64_int64();
+    void Grow(UINT64 seen) {
+        ReleaseSRWLockShared(&lock);
+        AcquireSRWLockExclusive(&lock);
+        if (nSlots == seen) {
+            UINT64 n = nSlots * 2;
+            volatile LONG64* bigger = AllocSlots(n);
+            for (UINT64 i = 0; i < nSlots; i++) {
+                if (slots[i] != 0) {
+                    UINT64 j = hashOf((char*)(slots[i] & ~SHARED_TAG)) & (n - 1);
+                    while (bigger[j] != 0) {
+                        j = (j + 1) & (n - 1);
+                    }
+                    bigger[j] = slots[i];
+                }
+            }
+            tablePages.Free((void*)slots, nSlots * sizeof(LONG64));
+            slots = bigger;
+            nSlots = n;
+        }
+        ReleaseSRWLockExclusive(&lock);
+        AcquireSRWLockShared(&lock);
+    }
+
+    template <typename F>
+    void ForEach(F f) {
+        for (UINT64 i = 0; i < nSlots; i++) {
+            if (slots[i] != 0) {
+                f((char*)(slots[i] & ~SHARED_TAG));
+            }
+        }
+    }
+};
+
+// word counts of one worker or of the run, in chained bins, swiss tables or a view of the SharedTable
+class HashTable {
+public:
+    INT64* hash; // offsets of the first entries of the bins
+    char* mainHashBuf;
+
+    UINT64 offset;
+    UINT64 capacity;
+
+    UINT64 nBins;
+    int size;
+    bool packed; // entries are ShortEntry and LongEntry, found by FindInsertPacked
+    int engine;
+    SwissTable<1, DWORD>* swiss; // packed words of up to PACKED_LANE letters
+    SwissTable<3, DWORD>* swissLong; // longer packed words
+    SwissTable<1, UINT64>* swissWords; // KEYS_HASH entries
+    SharedTable* shared;
+    SharedCursor cursor; // this view's part of the shared arena
+
+    // bins before the last doubling, while they still hold entries
+    INT64* oldHash;
+    UINT64 oldBins;
+    UINT64 migrated; // old bins moved so far
+
+    int upperToLower[256];
+
+    UINT64 max_depth = 0;
+    UINT64 lookup_total = 0;
+    UINT64 searches = 0;
+
+    // sharedTable is the table a TABLE_SHARED view works on; without one a new one is made
+    HashTable(int nB, bool packedKeys, int tableEngine, SharedTable* sharedTable = nullptr) {
+        nBins = nB;
+        size = 0;
+        packed = packedKeys;
+        engine = tableEngine;
+
+        hash = nullptr;
+        oldHash = nullptr;
+        swiss = nullptr;
+        swissLong = nullptr;
+        swissWords = nullptr;
+        shared = nullptr;
+        cursor.at = nullptr;
+        cursor.end = nullptr;
+        if (engine == TABLE_SHARED) {
+            shared = sharedTable != nullptr ? sharedTable : new SharedTable(nBins, packed ? PackedEntryHash : HeaderEntryHash);
+        }
+        else if (engine == TABLE_SWISS) {
+            if (packed) {
+                swiss = new SwissTable<1, DWORD>(nBins, ShortKeyHash);
+                swissLong = new SwissTable<3, DWORD>(nBins / 16, LongKeyHash);
+            }
+            else {
+                swissWords = new SwissTable<1, UINT64>(nBins, StoredHash);
+            }
+        }
+        else {
+            hash = AllocBins(nBins);
+        }
+
+        // the arena is only taken once something goes into it
+        mainHashBuf = nullptr;
+        offset = 0;
+        capacity = 0;
+
+        // UTF-8 words are stored with their multi-byte letters folded already
+        for (int i = 0; i < 256; ++i) {
+            upperToLower[i] = i;
         }
 
         for (char c = 'A'; c <= 'Z'; ++c) {
-            sboxLUT[c] = sboxLUT[c + 32];
+            upperToLower[c] = c + 32;
+        }
+    }
+
+    static INT64* AllocBins(UINT64 bins) {
+        INT64* b = (INT64*)tablePages.Alloc(bins * sizeof(INT64));
+        memset(b, -1, bins * sizeof(INT64)); // CHAIN_END
+        return b;
+    }
+
+    UINT64 EntryHash(const char* e) {
+        return packed ? PackedEntryHash(e) : HeaderEntryHash(e);
+    }
+
+    INT64 NextEntry(const char* e) {
+        if (!packed) {
+            return ((HashHeader*)e)->next_offset;
+        }
+        return (*(UINT64*)e & PACKED_LONG) ? ((LongEntry*)e)->link.Next() : ((ShortEntry*)e)->link.Next();
+    }
+
+    void SetNextEntry(char* e, INT64 off) {
+        if (!packed) {
+            ((HashHeader*)e)->next_offset = off;
+        }
+        else if (*(UINT64*)e & PACKED_LONG) {
+            ((LongEntry*)e)->link.SetNext(off);
+        }
+        else {
+            ((ShortEntry*)e)->link.SetNext(off);
+        }
+    }
+
+    // the bin the entries with hash h are in, an old one until it has been moved
+    INT64* BinOf(UINT64 h) {
+        if (oldHash != nullptr && (h & (oldBins - 1)) >= migrated) {
+            return &oldHash[h & (oldBins - 1)];
+        }
+        return &hash[h & (nBins - 1)];
+    }
+
+    // doubles the bins when too full, or moves a few more of the old bins
+    void ChainInserted() {
+        size++;
+        if (oldHash != nullptr) {
+            MigrateBins(CHAIN_MIGRATE);
+        }
+        else if ((UINT64)size > nBins * CHAIN_MAX_LOAD) {
+            oldHash = hash;
+            oldBins = nBins;
+            migrated = 0;
+            nBins *= 2;
+            hash = AllocBins(nBins);
+        }
+    }
+
+    // relinks the entries of the next old bins into the doubled ones; entries never move
+    void MigrateBins(UINT64 bins) {
+        UINT64 end = migrated + bins < oldBins ? migrated + bins : oldBins;
+        for (; migrated < end; migrated++) {
+            INT64 off = oldHash[migrated];
+            while (off != CHAIN_END) {
+                char* e = mainHashBuf + off;
+                INT64 next = NextEntry(e);
+                INT64* bin = &hash[EntryHash(e) & (nBins - 1)];
+                SetNextEntry(e, *bin);
+                *bin = off;
+                off = next;
+            }
+        }
+        if (migrated == oldBins) {
+            tablePages.Free(oldHash, oldBins * sizeof(INT64));
+            oldHash = nullptr;
+        }
+    }
+
+    // makes room for bytes more at offset; the arena commits in place so entries never move
+    void ArenaReserve(UINT64 bytes) {
+        if (offset + bytes < capacity) {
+            return;
+        }
+        if (mainHashBuf == nullptr) {
+            mainHashBuf = tablePages.TakeArena(&capacity);
+            if (offset + bytes < capacity) {
+                return;
+            }
+        }
+        UINT64 size = capacity != 0 ? capacity * 2 : ARENA_INITIAL;
+        while (offset + bytes >= size) {
+            size *= 2;
+        }
+        if (size > tablePages.arenaSpan && offset + bytes < tablePages.arenaSpan) {
+            size = tablePages.arenaSpan;
+        }
+        tablePages.GrowArena(mainHashBuf, capacity, size);
+        capacity = size;
+    }
+
+    // Gives the memory of a table that is done with, merged into another one, back to the pool.
+    void Release() {
+        tablePages.FreeArena(mainHashBuf, capacity);
+        mainHashBuf = nullptr;
+        if (hash != nullptr) {
+            tablePages.Free(hash, nBins * sizeof(INT64));
+            tablePages.Free(oldHash, oldBins * sizeof(INT64));
+        }
+        if (swiss != nullptr) {
+            swiss->Release();
+            swissLong->Release();
+        }
+        if (swissWords != nullptr) {
+            swissWords->Release();
+        }
+    }
+
+    // first step of a batched lookup: the bin, slot or group h starts at
+    void Prefetch(UINT64 h, bool isLong) {
+        if (engine == TABLE_SHARED) {
+            _mm_prefetch((const char*)&shared->slots[h & (shared->nSlots - 1)], _MM_HINT_T0);
+        }
+        else if (engine == TABLE_SWISS) {
+            if (!packed) {
+                swissWords->Prefetch(h);
+            }
+            else if (isLong) {
+                swissLong->Prefetch(h);
+            }
+            else {
+                swiss->Prefetch(h);
+            }
+        }
+        else {
+            _mm_prefetch((const char*)BinOf(h), _MM_HINT_T0);
+        }
+    }
+
+    // second step: the entry the bin or slot leads to
+    void PrefetchEntry(UINT64 h) {
+        if (engine == TABLE_SHARED) {
+            LONG64 v = shared->slots[h & (shared->nSlots - 1)];
+            if (v != 0) {
+                _mm_prefetch((const char*)(v & ~SHARED_TAG), _MM_HINT_T0);
+            }
+        }
+        else if (engine == TABLE_CHAIN) {
+            INT64 off = *BinOf(h);
+            if (off != CHAIN_END) {
+                _mm_prefetch(mainHashBuf + off, _MM_HINT_T0);
+            }
+        }
+    }
+
+    void CountProbes(UINT64 probes) {
+        lookup_total++;
+        searches += probes;
+        if (probes > max_depth) {
+            max_depth = probes;
+        }
+    }
+
+    // Finds the word with hash hashKey, or adds it with a count of 0. Only the hash is compared.
+    DWORD* FindInsertKey(UINT64 hashKey, const char* word, DWORD wordLen, bool& found) {
+        if (engine == TABLE_SHARED) {
+            UINT64 probes = 0;
+            char* e = shared->FindInsert(hashKey, sizeof(HashHeader) + sizeof(HashValue) + wordLen + 1, &cursor,
+                [&](const char* e) { return ((HashHeader*)e)->hash == hashKey; },
+                [&](char* e) {
+                    HashHeader* hH = (HashHeader*)e;
+                    HashValue* hV = (HashValue*)(hH + 1);
+                    hH->hash = hashKey;
+                    hV->counter = 0;
+                    memcpy(hV->GetWordPtr(), word, wordLen);
+                    hV->GetWordPtr()[wordLen] = '\0';
+                }, found, &probes);
+            CountProbes(probes);
+            if (!found) {
+                size++;
+            }
+            return &((HashValue*)(e + sizeof(HashHeader)))->counter;
+        }
+        if (engine == TABLE_SWISS) {
+            UINT64 probes = 0;
+            SwissTable<1, UINT64>::Slot* s = swissWords->FindInsert(&hashKey, hashKey, found, &probes);
+            CountProbes(probes);
+            if (!found) {
+                ArenaReserve(wordLen + 1);
+                s->value = offset;
+                memcpy(mainHashBuf + offset, word, wordLen);
+                mainHashBuf[offset + wordLen] = '\0';
+                offset += wordLen + 1;
+                size++;
+            }
+            return &s->counter;
+        }
+
+        int valueSize = sizeof(HashValue) + wordLen + 1;
+        HashValue* hv = FindInsertChained(hashKey, valueSize, found);
+        if (!found) {
+            hv->counter = 0;
+            memcpy(hv->GetWordPtr(), word, wordLen);
+            hv->GetWordPtr()[wordLen] = '\0';
+        }
+        return &hv->counter;
+    }
+
+    HashValue* FindInsertChained(UINT64 hashKey, int valueSize, bool& found) {
+        ArenaReserve(sizeof(HashHeader) + valueSize); // before any pointer into the arena is taken
+        INT64* bin = BinOf(hashKey);
+        lookup_total++;
+        searches++;
+        int temp_searches = 1;
+
+        //if hash offset is -1, instantiate to current offset and create hash entry
+        if (*bin == CHAIN_END) {
+            *bin = offset;
+
+            HashHeader* curr_hH = (HashHeader*) (mainHashBuf + offset);
+            curr_hH->hash = hashKey;
+            curr_hH->next_offset = CHAIN_END;
+            found = false;
+
+            offset += sizeof(HashHeader) + valueSize;
+            ChainInserted();
+
+            return (HashValue*)(curr_hH + 1);
+        }
+
+        else {
+            //if hash offset != -1, iterate through collision chain until word is found
+            HashHeader* curr_hH = (HashHeader*) (mainHashBuf + *bin);
+            HashValue* curr_hV = (HashValue*) (curr_hH + 1);
+            while(curr_hH->next_offset != CHAIN_END) {
+                searches++;
+                temp_searches++;
+                if (temp_searches > max_depth) {
+                    max_depth = temp_searches;
+                }
+                if (hashKey == curr_hH->hash) {
+                    found = true;
+                    return curr_hV;
+                }
+                else {
+                    curr_hH = (HashHeader*) (mainHashBuf + curr_hH->next_offset);
+                    curr_hV = (HashValue*) (curr_hH + 1);
+                }
+            }
+            if (hashKey == curr_hH->hash) {
+                found = true;
+                return curr_hV;
+            }
+            else { //if next pointer is -1 and word doesnt equal
+                curr_hH->next_offset = offset;
+
+                HashHeader* new_hH = (HashHeader*) (mainHashBuf + offset);
+                new_hH->hash = hashKey;
+                new_hH->next_offset = CHAIN_END;
+                found = false;
+
+                offset += sizeof(HashHeader) + valueSize;
+                ChainInserted();
+
+                return (HashValue*)(new_hH + 1);
+            }
+        }
+    }
+
+    // exact lookup of a packed word with h = PackedHash(key); a new entry starts with a count of 0
+    DWORD* FindInsertPacked(const PackedKey& key, UINT64 h, bool& found) {
+        bool isLong = (key.lane[0] & PACKED_LONG) != 0;
+        if (engine == TABLE_SHARED) {
+            UINT64 probes = 0;
+            int lanes = isLong ? 3 : 1;
+            char* e = shared->FindInsert(h, isLong ? sizeof(LongEntry) : sizeof(ShortEntry), &cursor,
+                [&](const char* e) { return memcmp(e, key.lane, lanes * sizeof(UINT64)) == 0; },
+                [&](char* e) {
+                    memcpy(e, key.lane, lanes * sizeof(UINT64));
+                    *(isLong ? &((LongEntry*)e)->counter : &((ShortEntry*)e)->counter) = 0;
+                }, found, &probes);
+            CountProbes(probes);
+            if (!found) {
+                size++;
+            }
+            return isLong ? &((LongEntry*)e)->counter : &((ShortEntry*)e)->counter;
+        }
+        if (engine == TABLE_SWISS) {
+            UINT64 probes = 0;
+            DWORD* counter = isLong ? &swissLong->FindInsert(key.lane, h, found, &probes)->counter
+                : &swiss->FindInsert(key.lane, h, found, &probes)->counter;
+            CountProbes(probes);
+            if (!found) {
+                size++;
+            }
+            return counter;
+        }
+
+        ArenaReserve(2 * sizeof(LongEntry)); // room for any entry after aligning it
+        INT64* bin = BinOf(h);
+        lookup_total++;
+        searches++;
+        UINT64 temp_searches = 1;
+
+        char* last = nullptr;
+        for (INT64 off = *bin; off != CHAIN_END; off = NextEntry(last)) {
+            char* e = mainHashBuf + off;
+            if (*(UINT64*)e & PACKED_LONG) {
+                LongEntry* le = (LongEntry*)e;
+                if (isLong && le->key[0] == key.lane[0] && le->key[1] == key.lane[1] && le->key[2] == key.lane[2]) {
+                    found = true;
+                    return &le->counter;
+                }
+            }
+            else {
+                ShortEntry* se = (ShortEntry*)e;
+                if (!isLong && se->key == key.lane[0]) {
+                    found = true;
+                    return &se->counter;
+                }
+            }
+            last = e;
+            searches++;
+            if (++temp_searches > max_depth) {
+                max_depth = temp_searches;
+            }
+        }
+
+        UINT64 entrySize = isLong ? sizeof(LongEntry) : sizeof(ShortEntry);
+        UINT64 at = (offset + entrySize - 1) & ~(entrySize - 1);
+        offset = at + entrySize;
+        found = false;
+
+        DWORD* counter;
+        if (isLong) {
+            LongEntry* le = (LongEntry*)(mainHashBuf + at);
+            memcpy(le->key, key.lane, sizeof(le->key));
+            le->link.SetNext(CHAIN_END);
+            counter = &le->counter;
+        }
+        else {
+            ShortEntry* se = (ShortEntry*)(mainHashBuf + at);
+            se->key = key.lane[0];
+            se->link.SetNext(CHAIN_END);
+            counter = &se->counter;
+        }
+        *counter = 0;
+        if (last == nullptr) {
+            *bin = at;
+        }
+        else {
+            SetNextEntry(last, at);
+        }
+        ChainInserted();
+        return counter;
+    }
+
+    // calls f(key, counter) for every entry of a packed table
+    template <typename F>
+    void ForEachPacked(F f) {
+        if (engine == TABLE_SWISS) {
+            swiss->ForEach([&](SwissTable<1, DWORD>::Slot* slot) {
+                PackedKey key = { { slot->key[0], 0, 0 } };
+                f(key, slot->counter);
+            });
+            swissLong->ForEach([&](SwissTable<3, DWORD>::Slot* slot) {
+                PackedKey key = { { slot->key[0], slot->key[1], slot->key[2] } };
+                f(key, slot->counter);
+            });
+            return;
+        }
+        ForEachEntry([&](char* e) {
+            PackedKey key;
+            if (*(UINT64*)e & PACKED_LONG) {
+                LongEntry* le = (LongEntry*)e;
+                memcpy(key.lane, le->key, sizeof(key.lane));
+                f(key, le->counter);
+            }
+            else {
+                ShortEntry* se = (ShortEntry*)e;
+                key.lane[0] = se->key;
+                key.lane[1] = 0;
+                key.lane[2] = 0;
+                f(key, se->counter);
+            }
+        });
+    }
+
+    // calls f(hash, word, counter) for every entry of a KEYS_HASH table
+    template <typename F>
+    void ForEachWord(F f) {
+        if (engine == TABLE_SWISS) {
+            swissWords->ForEach([&](SwissTable<1, UINT64>::Slot* slot) {
+                f(slot->key[0], mainHashBuf + slot->value, slot->counter);
+            });
+            return;
+        }
+        ForEachEntry([&](char* e) {
+            HashHeader* hH = (HashHeader*)e;
+            HashValue* hV = (HashValue*)(hH + 1);
+            f(hH->hash, hV->GetWordPtr(), hV->counter);
+        });
+    }
+
+    // calls f(entry) for every entry of a TABLE_CHAIN table, also those in bins not moved yet
+    template <typename F>
+    void ForEachEntry(F f) {
+        if (engine == TABLE_SHARED) {
+            shared->ForEach(f);
+            return;
+        }
+        for (UINT64 i = 0; i < nBins; i++) {
+            for (INT64 off = hash[i]; off != CHAIN_END; off = NextEntry(mainHashBuf + off)) {
+                f(mainHashBuf + off);
+            }
+        }
+        for (UINT64 i = migrated; oldHash != nullptr && i < oldBins; i++) {
+            for (INT64 off = oldHash[i]; off != CHAIN_END; off = NextEntry(mainHashBuf + off)) {
+                f(mainHashBuf + off);
+            }
+        }
+    }
+
+    void toLower(char* cstr) {
+        int i = 0;
+        while(cstr[i] != '\0') {
+            cstr[i] = upperToLower[(unsigned char)cstr[i]];
+            i++;
+        }
+    }
+
+    void tallyWordLengths() {
+        DWORD* countBuf = new DWORD[LONGEST_WORD_UTF8 + 1];
+        memset(countBuf, 0, sizeof(DWORD) * (LONGEST_WORD_UTF8 + 1));
+        int printBufIndex = 0;
+
+        if (packed) {
+            ForEachPacked([&](const PackedKey& key, DWORD counter) {
+                char word[32];
+                countBuf[UnpackWord(&key, word)]++;
+            });
+        }
+        else {
+            ForEachWord([&](UINT64 hashKey, char* word, DWORD counter) {
+                countBuf[strlen(word)]++;
+            });
+        }
+
+        for (int i = 3; i <= 31; i++) {
+            printf("%lu\n", countBuf[i]);
+        }
+    }
+};
+
+// a word watched by a SpaceSaving summary; count is at most error above the true count
+class HeavyCounter {
+public:
+    UINT64 key[3]; // the packed key, or the word hash in key[0] under KEYS_HASH
+    UINT64 hash;
+    DWORD count;
+    DWORD error;
+    int bucket;
+    int prev; // counters of the same bucket, -1 at either end
+    int next;
+};
+
+// The counters with one count, in a list ordered by the count.
+class HeavyBucket {
+public:
+    DWORD count;
+    int first;
+    int prev;
+    int next; // also links free buckets
+};
+
+// the most frequent words in K Space-Saving counters, in count buckets with an open-addressing index
+class SpaceSaving {
+public:
+    int k;
+    int n; // counters in use
+    bool packed;
+    bool exact; // no word has been pushed out, so the counts are exact and n is the vocabulary
+    HeavyCounter* counters;
+    char* words; // LONGEST_WORD_UTF8 + 1 bytes per counter under KEYS_HASH
+    HeavyBucket* buckets;
+    int minBucket; // -1 while no word is counted
+    int freeBucket;
+    UINT64* index; // low 32 bits of the hash over the counter number, HEAVY_FREE where free
+    UINT64 indexMask;
+
+    SpaceSaving(int counters_, bool packedKeys) {
+        k = counters_;
+        n = 0;
+        packed = packedKeys;
+        exact = true;
+        counters = new HeavyCounter[k];
+        words = packed ? nullptr : new char[(UINT64)k * (LONGEST_WORD_UTF8 + 1)];
+        // every bucket in use holds a counter, and a raise may need one more for a moment
+        buckets = new HeavyBucket[k + 1];
+        for (int b = 0; b <= k; b++) {
+            buckets[b].next = b + 1 <= k ? b + 1 : -1;
+        }
+        freeBucket = 0;
+        minBucket = -1;
+        UINT64 size = 1;
+        while (size < 2 * (UINT64)k) {
+            size *= 2;
+        }
+        index = new UINT64[size];
+        indexMask = size - 1;
+        memset(index, 0xFF, size * sizeof(UINT64));
+    }
+
+    bool SameKey(const UINT64* a, const UINT64* b) {
+        return a[0] == b[0] && a[1] == b[1] && a[2] == b[2];
+    }
+
+    char* WordOf(int c) {
+        return words + (UINT64)c * (LONGEST_WORD_UTF8 + 1);
+    }
+
+    DWORD MinCount() {
+        return buckets[minBucket].count;
+    }
+
+    void Prefetch(UINT64 h) {
+        _mm_prefetch((const char*)&index[h & indexMask], _MM_HINT_T0);
+    }
+
+    // once the index line has arrived, the counter the probe most likely ends at
+    void PrefetchCounter(UINT64 h) {
+        UINT64 e = index[h & indexMask];
+        if (e != HEAVY_FREE) {
+            _mm_prefetch((const char*)&counters[(DWORD)e], _MM_HINT_T0);
+        }
+    }
+
+    // counts one more of a word; key is its packed key or its hash and two zero lanes
+    void Add(const UINT64* key, UINT64 h, const char* word, DWORD len) {
+        UINT64 tag = h << 32;
+        UINT64 i = h & indexMask;
+        for (; index[i] != HEAVY_FREE; i = (i + 1) & indexMask) {
+            int c = (DWORD)index[i];
+            if ((index[i] & 0xFFFFFFFF00000000ULL) == tag && SameKey(counters[c].key, key)) {
+                Raise(c);
+                return;
+            }
+        }
+
+        int c;
+        if (n < k) {
+            c = n++;
+            counters[c].count = 0;
+            counters[c].error = 0;
+            if (minBucket == -1 || buckets[minBucket].count != 0) {
+                // a bucket for count 0 that the first raise empties again
+                int b = NewBucket(0, -1, minBucket);
+                minBucket = b;
+            }
+            Link(c, minBucket);
+        }
+        else {
+            // the least frequent word gives up its counter
+            c = buckets[minBucket].first;
+            Unindex(c);
+            for (i = h & indexMask; index[i] != HEAVY_FREE; i = (i + 1) & indexMask) {
+            }
+            counters[c].error = counters[c].count;
+            exact = false;
+        }
+        memcpy(counters[c].key, key, sizeof(counters[c].key));
+        counters[c].hash = h;
+        if (!packed) {
+            // the copy is lowered right away
+            char* w = WordOf(c);
+            for (DWORD j = 0; j < len; j++) {
+                w[j] = word[j] >= 'A' && word[j] <= 'Z' ? word[j] + 32 : word[j];
+            }
+            w[len] = '\0';
+        }
+        index[i] = tag | (DWORD)c;
+        Raise(c);
+    }
+
+    // Moves counter c to the bucket one count up, which is the next one or a new one after its own.
+    void Raise(int c) {
+        int b = counters[c].bucket;
+        DWORD count = ++counters[c].count;
+        int up = buckets[b].next;
+        if (up == -1 || buckets[up].count != count) {
+            if (buckets[b].first == c && counters[c].next == -1) {
+                buckets[b].count = count; // alone in its bucket, which keeps its place
+                return;
+            }
+            up = NewBucket(count, b, up);
+        }
+        Unlink(c);
+        Link(c, up);
+    }
+
+    int NewBucket(DWORD count, int prev, int next) {
+        int b = freeBucket;
+        freeBucket = buckets[b].next;
+        buckets[b].count = count;
+        buckets[b].first = -1;
+        buckets[b].prev = prev;
+        buckets[b].next = next;
+        if (prev != -1) {
+            buckets[prev].next = b;
+        }
+        if (next != -1) {
+            buckets[next].prev = b;
+        }
+        return b;
+    }
+
+    void Link(int c, int b) {
+        counters[c].bucket = b;
+        counters[c].prev = -1;
+        counters[c].next = buckets[b].first;
+        if (buckets[b].first != -1) {
+            counters[buckets[b].first].prev = c;
+        }
+        buckets[b].first = c;
+    }
+
+    // Takes counter c out of its bucket, and the bucket out of the list once it is empty.
+    void Unlink(int c) {
+        int b = counters[c].bucket;
+        if (counters[c].prev != -1) {
+            counters[counters[c].prev].next = counters[c].next;
+        }
+        else {
+            buckets[b].first = counters[c].next;
+        }
+        if (counters[c].next != -1) {
+            counters[counters[c].next].prev = counters[c].prev;
+        }
+        if (buckets[b].first != -1) {
+            return;
+        }
+        if (buckets[b].prev != -1) {
+            buckets[buckets[b].prev].next = buckets[b].next;
+        }
+        else {
+            minBucket = buckets[b].next;
+        }
+        if (buckets[b].next != -1) {
+            buckets[buckets[b].next].prev = buckets[b].prev;
+        }
+        buckets[b].next = freeBucket;
+        freeBucket = b;
+    }
+
+    // takes counter c out of the index, moving back the entries of its probe run
+    void Unindex(int c) {
+        UINT64 hole = counters[c].hash & indexMask;
+        while ((DWORD)index[hole] != (DWORD)c) {
+            hole = (hole + 1) & indexMask;
+        }
+        for (UINT64 j = (hole + 1) & indexMask; index[j] != HEAVY_FREE; j = (j + 1) & indexMask) {
+            UINT64 home = (index[j] >> 32) & indexMask;
+            if (((j - home) & indexMask) >= ((j - hole) & indexMask)) {
+                index[hole] = index[j];
+                hole = j;
+            }
+        }
+        index[hole] = HEAVY_FREE;
+    }
+
+    // merges the workers' summaries into this empty one, keeping the K highest counts
+    void Merge(std::vector<SpaceSaving*>& parts) {
+        std::vector<std::pair<SpaceSaving*, int>> all;
+        UINT64 base = 0;
+        for (size_t p = 0; p < parts.size(); p++) {
+            SpaceSaving* s = parts[p];
+            if (!s->exact) {
+                base += s->MinCount();
+                exact = false;
+            }
+            for (int c = 0; c < s->n; c++) {
+                all.push_back(std::make_pair(s, c));
+            }
+        }
+        std::sort(all.begin(), all.end(), [](const std::pair<SpaceSaving*, int>& a, const std::pair<SpaceSaving*, int>& b) {
+            return memcmp(a.first->counters[a.second].key, b.first->counters[b.second].key, sizeof(a.first->counters[0].key)) < 0;
+        });
+
+        std::vector<HeavyCounter> merged;
+        std::vector<const char*> mergedWords;
+        for (size_t i = 0; i < all.size(); ) {
+            HeavyCounter m = all[i].first->counters[all[i].second];
+            const char* word = packed ? nullptr : all[i].first->WordOf(all[i].second);
+            INT64 count = base;
+            INT64 error = base;
+            for (; i < all.size() && memcmp(all[i].first->counters[all[i].second].key, m.key, sizeof(m.key)) == 0; i++) {
+                SpaceSaving* s = all[i].first;
+                HeavyCounter* c = &s->counters[all[i].second];
+                INT64 floor = s->exact ? 0 : s->MinCount();
+                count += c->count - floor;
+                error += c->error - floor;
+            }
+            m.count = (DWORD)count;
+            m.error = (DWORD)error;
+            merged.push_back(m);
+            mergedWords.push_back(word);
+        }
+
+        std::vector<int> order(merged.size());
+        for (size_t i = 0; i < order.size(); i++) {
+            order[i] = (int)i;
+        }
+        if (order.size() > (size_t)k) {
+            std::nth_element(order.begin(), order.begin() + k, order.end(), [&](int a, int b) { return merged[a].count > merged[b].count; });
+            order.resize(k);
+            exact = false;
+        }
+        n = (int)order.size();
+        for (int c = 0; c < n; c++) {
+            counters[c] = merged[order[c]];
+            if (!packed) {
+                strcpy(WordOf(c), mergedWords[order[c]]);
+            }
+        }
+    }
+
+    // the largest error of any count, N / K at most
+    DWORD MaxError() {
+        DWORD most = 0;
+        for (int c = 0; c < n; c++) {
+            if (counters[c].error > most) {
+                most = counters[c].error;
+            }
+        }
+        return most;
+    }
+
+    // sorts only the K counters, and with a top only that far
+    void PrintContents(ReportWriter& report) {
+        char* unpacked = packed ? new char[(UINT64)n * 32] : nullptr;
+        std::vector<WordEntry> printBuf(n);
+        std::vector<DWORD> errors(n);
+        for (int c = 0; c < n; c++) {
+            char* word;
+            if (packed) {
+                PackedKey key = { { counters[c].key[0], counters[c].key[1], counters[c].key[2] } };
+                word = unpacked + (UINT64)c * 32;
+                UnpackWord(&key, word);
+            }
+            else {
+                word = WordOf(c);
+            }
+            printBuf[c].counter = counters[c].count;
+            printBuf[c].wordPointer = word;
+        }
+        std::vector<int> order(n);
+        for (int c = 0; c < n; c++) {
+            order[c] = c;
+        }
+        int listed = report.top > 0 && report.top < n ? report.top : n;
+        std::partial_sort(order.begin(), order.begin() + listed, order.end(), [&](int a, int b) { return printBuf[a] < printBuf[b]; });
+        std::vector<WordEntry> ranked(listed);
+        for (int i = 0; i < listed; i++) {
+            ranked[i] = printBuf[order[i]];
+            errors[i] = counters[order[i]].error;
+        }
+        report.Write(ranked.data(), errors.data(), listed);
+        delete[] unpacked;
+    }
+};
+
+// a HyperLogLog sketch of the distinct word hashes, merged register by register
+class HyperLogLog {
+public:
+    UCHAR reg[HLL_REGISTERS];
+
+    HyperLogLog() {
+        memset(reg, 0, sizeof(reg));
+    }
+
+    void Add(UINT64 h) {
+        UCHAR* r = &reg[h >> (64 - HLL_PRECISION)];
+        unsigned long top;
+        _BitScanReverse64(&top, h << HLL_PRECISION | 1ULL << (HLL_PRECISION - 1)); // stops the rank at 64 - HLL_PRECISION + 1
+        UCHAR rank = (UCHAR)(64 - top);
+        if (rank > *r) {
+            *r = rank;
+        }
+    }
+
+    void Merge(const HyperLogLog* other) {
+        for (int i = 0; i < HLL_REGISTERS; i += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(reg + i));
+            __m128i b = _mm_loadu_si128((const __m128i*)(other->reg + i));
+            _mm_storeu_si128((__m128i*)(reg + i), _mm_max_epu8(a, b));
+        }
+    }
+
+    // with linear counting of the empty registers for small sets, where it is more accurate
+    UINT64 Estimate() {
+        double sum = 0;
+        int zeros = 0;
+        for (int i = 0; i < HLL_REGISTERS; i++) {
+            sum += ldexp(1.0, -reg[i]);
+            zeros += reg[i] == 0;
+        }
+        double m = HLL_REGISTERS;
+        double e = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+        if (e <= 2.5 * m && zeros != 0) {
+            e = m * log(m / zeros);
+        }
+        return (UINT64)(e + 0.5);
+    }
+};
+
+// word counts split into shards by hash bits, so each shard of the result is merged by one worker
+class TableShards {
+public:
+    HashTable** shard;
+    int nShards; // a power of 2, or 0 when words are not counted one by one
+    SpaceSaving* heavy; // the summary kept instead of shards under COUNT_HEAVY
+    HyperLogLog* sketch; // or the sketch under COUNT_ESTIMATE
+
+    // with a shared table, every worker's set is one view of it
+    TableShards(int n, int nB, bool packedKeys, int tableEngine, SharedTable* sharedTable) {
+        nShards = n;
+        heavy = nullptr;
+        sketch = nullptr;
+        shard = new HashTable*[n];
+        int bins = nB / n > MERGE_PART_MIN_BINS ? nB / n : MERGE_PART_MIN_BINS;
+        for (int i = 0; i < n; i++) {
+            shard[i] = new HashTable(bins, packedKeys, tableEngine, sharedTable);
+        }
+    }
+
+    TableShards(SpaceSaving* summary) {
+        nShards = 0;
+        shard = nullptr;
+        heavy = summary;
+        sketch = nullptr;
+    }
+
+    TableShards(HyperLogLog* hll) {
+        nShards = 0;
+        shard = nullptr;
+        heavy = nullptr;
+        sketch = hll;
+    }
+
+    HashTable* ShardOf(UINT64 h) {
+        return shard[(h >> MERGE_PART_SHIFT) & (nShards - 1)];
+    }
+
+    int Size() {
+        if (heavy != nullptr) {
+            return heavy->n;
+        }
+        int size = 0;
+        for (int i = 0; i < nShards; i++) {
+            size += shard[i]->size;
+        }
+        return size;
+    }
+
+    // counting sort into count and first-byte groups, then the groups are sorted on all threads
+    void PrintContents(ReportWriter& report) {
+        if (heavy != nullptr) {
+            heavy->PrintContents(report);
+            return;
+        }
+        if (sketch != nullptr) {
+            return; // there are no words to list
+        }
+        int threads = report.threads;
+        int size = Size();
+        WordEntry* printBuf = new WordEntry[size];
+        bool packed = shard[0]->packed;
+        // the words only exist as strings for the report
+        char* words = packed ? new char[(UINT64)size * 32] : nullptr;
+
+        // each shard goes where the ones before it end
+        std::vector<int> base(nShards + 1, 0);
+        for (int s = 0; s < nShards; s++) {
+            base[s + 1] = base[s] + shard[s]->size;
+        }
+        volatile LONG nextShard = 0;
+        RunThreads(threads, [&](int t) {
+            for (LONG s; (s = InterlockedIncrement(&nextShard) - 1) < nShards; ) {
+                int i = base[s];
+                if (packed) {
+                    shard[s]->ForEachPacked([&](const PackedKey& key, DWORD counter) {
+                        memcpy(words + (UINT64)i * 32, &key, sizeof(key)); // unpacked in place below
+                        printBuf[i].counter = counter;
+                        printBuf[i].wordPointer = words + (UINT64)i * 32;
+                        i++;
+                    });
+                }
+                else {
+                    shard[s]->ForEachWord([&](UINT64 hashKey, char* word, DWORD counter) {
+                        printBuf[i].counter = counter;
+                        printBuf[i++].wordPointer = word;
+                    });
+                }
+            }
+        });
+        if (report.top > 0 && report.top < size) {
+            PrintTop(report, printBuf, size, packed);
+            delete[] printBuf;
+            delete[] words;
+            return;
+        }
+
+        const int nGroups = 1 + SORT_COUNTS * 256;
+        auto groupOf = [](const WordEntry& e) {
+            return e.counter >= SORT_COUNTS ? 0 : 1 + (SORT_COUNTS - 1 - (int)e.counter) * 256 + (UCHAR)e.wordPointer[0];
+        };
+        std::vector<int> next((UINT64)threads * nGroups, 0); // entries of each range by group, then where they go
+        RunThreads(threads, [&](int t) {
+            int* n = &next[(UINT64)t * nGroups];
+            for (int i = (int)((INT64)size * t / threads); i < (int)((INT64)size * (t + 1) / threads); i++) {
+                SpellWord(printBuf[i].wordPointer, packed);
+                n[groupOf(printBuf[i])]++;
+            }
+        });
+
+        std::vector<int> groupStart(nGroups + 1);
+        int at = 0;
+        for (int g = 0; g < nGroups; g++) {
+            groupStart[g] = at;
+            for (int t = 0; t < threads; t++) {
+                int n = next[(UINT64)t * nGroups + g];
+                next[(UINT64)t * nGroups + g] = at;
+                at += n;
+            }
+        }
+        groupStart[nGroups] = at;
+
+        WordEntry* sorted = new WordEntry[size];
+        RunThreads(threads, [&](int t) {
+            int* n = &next[(UINT64)t * nGroups];
+            for (int i = (int)((INT64)size * t / threads); i < (int)((INT64)size * (t + 1) / threads); i++) {
+                sorted[n[groupOf(printBuf[i])]++] = printBuf[i];
+            }
+        });
+        delete[] printBuf;
+
+        std::vector<int> order;
+        for (int g = 0; g < nGroups; g++) {
+            if (groupStart[g + 1] > groupStart[g]) {
+                order.push_back(g);
+            }
+        }
+        std::sort(order.begin(), order.end(), [&](int a, int b) {
+            return groupStart[a + 1] - groupStart[a] > groupStart[b + 1] - groupStart[b];
+        });
+        volatile LONG nextGroup = 0;
+        RunThreads(threads, [&](int t) {
+            for (LONG k; (k = InterlockedIncrement(&nextGroup) - 1) < (LONG)order.size(); ) {
+                std::sort(sorted + groupStart[order[k]], sorted + groupStart[order[k] + 1]);
+            }
+        });
+
+        report.Write(sorted, nullptr, size);
+
+        delete[] sorted;
+        delete[] words;
+    }
+
+    // lists only the report.top first words; each thread keeps its top counts and their ties
+    void PrintTop(ReportWriter& report, WordEntry* printBuf, int size, bool packed) {
+        int threads = report.threads;
+        int top = report.top;
+        std::vector<int> kept(threads);
+        RunThreads(threads, [&](int t) {
+            WordEntry* from = printBuf + (INT64)size * t / threads;
+            WordEntry* to = printBuf + (INT64)size * (t + 1) / threads;
+            if (to - from <= top) {
+                kept[t] = (int)(to - from);
+                return;
+            }
+            std::nth_element(from, from + top - 1, to, [](const WordEntry& a, const WordEntry& b) { return a.counter > b.counter; });
+            DWORD lowest = from[top - 1].counter;
+            kept[t] = (int)(std::partition(from + top, to, [&](const WordEntry& e) { return e.counter == lowest; }) - from);
+        });
+
+        std::vector<WordEntry> candidates;
+        for (int t = 0; t < threads; t++) {
+            WordEntry* from = printBuf + (INT64)size * t / threads;
+            candidates.insert(candidates.end(), from, from + kept[t]);
+        }
+        int n = (int)candidates.size();
+        RunThreads(threads, [&](int t) {
+            for (int i = (int)((INT64)n * t / threads); i < (int)((INT64)n * (t + 1) / threads); i++) {
+                SpellWord(candidates[i].wordPointer, packed);
+            }
+        });
+        std::nth_element(candidates.begin(), candidates.begin() + top - 1, candidates.end());
+        std::sort(candidates.begin(), candidates.begin() + top);
+        report.Write(candidates.data(), nullptr, top);
+    }
+
+    // Turns a packed key copied out for the report into its word, or lowers a stored word.
+    void SpellWord(char* word, bool packed) {
+        if (packed) {
+            PackedKey key;
+            memcpy(&key, word, sizeof(key));
+            UnpackWord(&key, word);
+        }
+        else {
+            shard[0]->toLower(word);
+        }
+    }
+};
+
+// words of a chunk waiting to be counted, each prefetched as it is added
+class InsertBatch {
+public:
+    int n;
+    HashTable* table[INSERT_BATCH_MAX];
+    UINT64 hash[INSERT_BATCH_MAX];
+    PackedKey key[INSERT_BATCH_MAX];
+    char* word[INSERT_BATCH_MAX];
+    DWORD len[INSERT_BATCH_MAX];
+    char copies[INSERT_BATCH_MAX][LONGEST_WORD_UTF8]; // folded UTF-8 words, whose buffer is reused
+    SpaceSaving* heavy; // where the words go under COUNT_HEAVY instead of table
+
+    InsertBatch() {
+        n = 0;
+        heavy = nullptr;
+    }
+};
+
+class RunConfig {
+public:
+    int bufExp; // log2 of the slot size B
+    bool autoTune; // buf_size was "auto": B and the slot count are picked at run time
+    std::vector<char*> inputs; // files after expanding directories and wildcards
+    int readerMode;
+    int queueDepth; // reads in flight for READER_OVERLAPPED
+    int nReaders; // reader threads for READER_PARALLEL, decoder threads for READER_BZIP2
+    char* indexName; // multistream offset index for READER_BZIP2, optional
+    int cachePolicy;
+    int simdLevel; // highest tokenizer kernel allowed, CPUID decides within that
+    int hashMode;
+    int charset;
+    int filterMode;
+    int keyMode;
+    int tableEngine;
+    int insertBatch; // words per prefetched insert batch, 1 counts every word right away
+    int pages;
+    int placement;
+    int countMode;
+    int heavyCounters;
+    int reportParts; // files the word listing is split into, 1 keeps it in report.txt
+    int top; // most frequent words listed, 0 lists all
+    char* saveName; // word index written next to the report, optional
+
+    RunConfig() {
+        bufExp = 0;
+        autoTune = false;
+        readerMode = READER_SYNC;
+        queueDepth = 32;
+        nReaders = 4;
+        indexName = nullptr;
+        cachePolicy = CACHE_NORMAL;
+        simdLevel = SIMD_AVX512;
+        hashMode = HASH_MIX;
+        charset = CHARSET_ASCII;
+        filterMode = FILTER_NONE;
+        keyMode = KEYS_PACKED;
+        tableEngine = TABLE_SWISS;
+        insertBatch = INSERT_BATCH;
+        pages = PAGES_LARGE;
+        placement = PLACE_NUMA;
+        countMode = COUNT_EXACT;
+        heavyCounters = HEAVY_COUNTERS;
+        reportParts = 1;
+        top = 0;
+        saveName = nullptr;
+    }
+
+    bool Parse(int argc, char* argv[]) {
+        int positional = 0;
+        for (int i = 1; i < argc; i++) {
+            if (argv[i][0] == '-') {
+                if (i + 1 >= argc) {
+                    return false;
+                }
+                char* opt = argv[i];
+                char* val = argv[++i];
+                if (strcmp(opt, "-io") == 0) {
+                    if (strcmp(val, "sync") == 0) {
+                        readerMode = READER_SYNC;
+                    }
+                    else if (strcmp(val, "overlapped") == 0) {
+                        readerMode = READER_OVERLAPPED;
+                    }
+                    else if (strcmp(val, "mapped") == 0) {
+                        readerMode = READER_MAPPED;
+                    }
+                    else if (strcmp(val, "parallel") == 0) {
+                        readerMode = READER_PARALLEL;
+                    }
+                    else {
+                        return false;
+                    }
+                }
+                else if (strcmp(opt, "-qd") == 0) {
+                    queueDepth = atoi(val);
+                    if (queueDepth < 1) {
+                        return false;
+                    }
+                }
+                else if (strcmp(opt, "-pages") == 0) {
+                    if (strcmp(val, "normal") == 0) {
+                        pages = PAGES_NORMAL;
+                    }
+                    else if (strcmp(val, "large") == 0) {
+                        pages = PAGES_LARGE;
+                    }
+                    else {
+                        return false;
+                    }
+                }
+                else if (strcmp(opt, "-place") == 0) {
+                    if (strcmp(val, "numa") == 0) {
+                        placement = PLACE_NUMA;
+                    }
+                    else if (strcmp(val, "none") == 0) {
+                        placement = PLACE_NONE;
+                    }
+                    else {
+                        return false;
+                    }
+                }
+                else if (strcmp(opt, "-count") == 0) {
+                    if (strcmp(val, "exact") == 0) {
+                        countMode = COUNT_EXACT;
+                    }
+                    else if (strcmp(val, "heavy") == 0) {
+                        countMode = COUNT_HEAVY;
+                    }
+                    else if (strcmp(val, "estimate") == 0) {
+                        countMode = COUNT_ESTIMATE;
+                    }
+                    else {
+                        return false;
+                    }
+                }
+                else if (strcmp(opt, "-counters") == 0) {
+                    heavyCounters = atoi(val);
+                    if (heavyCounters < 1) {
+                        return false;
+                    }
+                }
+                else if (strcmp(opt, "-parts") == 0) {
+                    reportParts = atoi(val);
+                    if (reportParts < 1 || reportParts > REPORT_PARTS_MAX) {
+                        return false;
+                    }
+                }
+                else if (strcmp(opt, "-top") == 0) {
+                    top = atoi(val);
+                    if (top < 1) {
+                        return false;
+                    }
+                }
+                else if (strcmp(opt, "-save") == 0) {
+                    saveName = val;
+                }
+                else if (strcmp(opt, "-batch") == 0) {
+                    insertBatch = atoi(val);
+                    if (insertBatch < 1 || insertBatch > INSERT_BATCH_MAX) {
+                        return false;
+                    }
+                }
+                else if (strcmp(opt, "-readers") == 0) {
+                    nReaders = atoi(val);
+                    if (nReaders < 1) {
+                        return false;
+                    }
+                }
+                else if (strcmp(opt, "-index") == 0) {
+                    indexName = val;
+                }
+                else if (strcmp(opt, "-simd") == 0) {
+                    const char* names[] = { "scalar", "sse42", "avx2", "avx512" };
+                    simdLevel = -1;
+                    for (int j = SIMD_SCALAR; j <= SIMD_AVX512; j++) {
+                        if (strcmp(val, names[j]) == 0) {
+                            simdLevel = j;
+                        }
+                    }
+                    if (simdLevel < 0) {
+                        return false;
+                    }
+                }
+                else if (strcmp(opt, "-cache") == 0) {
+                    if (strcmp(val, "normal") == 0) {
+                        cachePolicy = CACHE_NORMAL;
+                    }
+                    else if (strcmp(val, "stream") == 0) {
+                        cachePolicy = CACHE_STREAM;
+                    }
+                    else {
+                        return false;
+                    }
+                }
+                else if (strcmp(opt, "-charset") == 0) {
+                    if (strcmp(val, "ascii") == 0) {
+                        charset = CHARSET_ASCII;
+                    }
+                    else if (strcmp(val, "utf8") == 0) {
+                        charset = CHARSET_UTF8;
+                    }
+                    else {
+                        return false;
+                    }
+                }
+                else if (strcmp(opt, "-filter") == 0) {
+                    if (strcmp(val, "none") == 0) {
+                        filterMode = FILTER_NONE;
+                    }
+                    else if (strcmp(val, "wiki") == 0) {
+                        filterMode = FILTER_WIKI;
+                    }
+                    else {
+                        return false;
+                    }
+                }
+                else if (strcmp(opt, "-table") == 0) {
+                    if (strcmp(val, "chain") == 0) {
+                        tableEngine = TABLE_CHAIN;
+                    }
+                    else if (strcmp(val, "swiss") == 0) {
+                        tableEngine = TABLE_SWISS;
+                    }
+                    else if (strcmp(val, "shared") == 0) {
+                        tableEngine = TABLE_SHARED;
+                    }
+                    else {
+                        return false;
+                    }
+                }
+                else if (strcmp(opt, "-keys") == 0) {
+                    if (strcmp(val, "packed") == 0) {
+                        keyMode = KEYS_PACKED;
+                    }
+                    else if (strcmp(val, "hash") == 0) {
+                        keyMode = KEYS_HASH;
+                    }
+                    else {
+                        return false;
+                    }
+                }
+                else if (strcmp(opt, "-hash") == 0) {
+                    if (strcmp(val, "sbox") == 0) {
+                        hashMode = HASH_SBOX;
+                    }
+                    else if (strcmp(val, "mix") == 0) {
+                        hashMode = HASH_MIX;
+                    }
+                    else {
+                        return false;
+                    }
+                }
+                else {
+                    return false;
+                }
+            }
+            else if (positional == 0) {
+                if (strcmp(argv[i], "auto") == 0) {
+                    autoTune = true;
+                    bufExp = TUNE_START_EXP;
+                }
+                else {
+                    bufExp = atoi(argv[i]);
+                }
+                positional++;
+            }
+            else {
+                if (!ExpandInput(argv[i])) {
+                    printf("No input files match %s\n", argv[i]);
+                    return false;
+                }
+                positional++;
+            }
+        }
+        if (positional < 2) {
+            return false;
+        }
+
+        // compressed dumps can only go through the bzip2 reader, and then all inputs must be
+        int compressed = 0;
+        for (size_t i = 0; i < inputs.size(); i++) {
+            size_t len = strlen(inputs[i]);
+            if (len > 4 && _stricmp(inputs[i] + len - 4, ".bz2") == 0) {
+                compressed++;
+            }
+        }
+        if (compressed > 0) {
+            if (compressed != inputs.size()) {
+                printf("Cannot mix .bz2 and plain inputs\n");
+                return false;
+            }
+            readerMode = READER_BZIP2;
+        }
+        if (indexName != nullptr && inputs.size() != 1) {
+            printf("-index needs a single input\n");
+            return false;
+        }
+        if (saveName != nullptr && countMode == COUNT_ESTIMATE) {
+            printf("-save needs a word list, which -count estimate does not keep\n");
+            return false;
+        }
+        return true;
+    }
+
+    // a directory or wildcard adds the files it holds or matches in name order, anything else is a file name
+    bool ExpandInput(char* arg) {
+        DWORD attr = GetFileAttributes(arg);
+        bool wildcard = strchr(arg, '*') != nullptr || strchr(arg, '?') != nullptr;
+        if (!wildcard && (attr == INVALID_FILE_ATTRIBUTES || !(attr & FILE_ATTRIBUTE_DIRECTORY))) {
+            inputs.push_back(arg);
+            return true;
+        }
+
+        char dir[MAX_PATH];
+        char pattern[MAX_PATH];
+        if (wildcard) {
+            char* slash = strrchr(arg, '\\');
+            char* fwd = strrchr(arg, '/');
+            if (slash == nullptr || (fwd != nullptr && fwd > slash)) {
+                slash = fwd;
+            }
+            int dirLen = slash == nullptr ? 0 : (int)(slash - arg) + 1;
+            _snprintf(dir, MAX_PATH, "%.*s", dirLen, arg);
+            _snprintf(pattern, MAX_PATH, "%s", arg);
+        }
+        else {
+            _snprintf(dir, MAX_PATH, "%s\\", arg);
+            _snprintf(pattern, MAX_PATH, "%s\\*", arg);
+        }
+
+        WIN32_FIND_DATA fd;
+        HANDLE hFind = FindFirstFile(pattern, &fd);
+        if (hFind == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        size_t firstNew = inputs.size();
+        do {
+            if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+                continue;
+            }
+            char* name = (char*)malloc(strlen(dir) + strlen(fd.cFileName) + 1);
+            strcpy(name, dir);
+            strcat(name, fd.cFileName);
+            inputs.push_back(name);
+        } while (FindNextFile(hFind, &fd));
+        FindClose(hFind);
+
+        std::sort(inputs.begin() + firstNew, inputs.end(), [](char* a, char* b) { return strcmp(a, b) < 0; });
+        return inputs.size() > firstNew;
+    }
+};
+
+class ReadRequest {
+public:
+    OVERLAPPED ov; // first member, so the completion packet maps straight back to the request
+    int slotID;
+    DWORD shadowBytes; // bytes of the previous chunk read in front of the data
+};
+
+// masks of the aligned block last classified, bit i for base[i], plus the UTF-8 word state
+class TokenCursor {
+public:
+    const char* base;
+    UINT64 alpha;
+    UINT64 delim;
+    UINT64 high; // bytes of multi-byte characters
+    DWORD wide;
+    DWORD foldedLen;
+    char folded[8 + LONGEST_WORD_UTF8]; // the word starts at folded + 8, HashWord may read in front of it
+};
+
+// classifies a block through a low and a high nibble table into letter, delimiter and high-byte masks
+typedef void (*ClassifyFn)(const char* block, const UCHAR* loTable, const UCHAR* hiTable, UCHAR alphaBits, UCHAR delimBits, UINT64* alpha, UINT64* delim, UINT64* high);
+
+void ClassifySSE42(const char* block, const UCHAR* loTable, const UCHAR* hiTable, UCHAR alphaBits, UCHAR delimBits, UINT64* alpha, UINT64* delim, UINT64* high) {
+    __m128i nibble = _mm_set1_epi8(0x0F);
+    __m128i v = _mm_load_si128((const __m128i*)block);
+    __m128i lo = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)loTable), _mm_and_si128(v, nibble));
+    __m128i hi = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)hiTable), _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+    __m128i bits = _mm_and_si128(lo, hi);
+    __m128i zero = _mm_setzero_si128();
+    *alpha = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(bits, _mm_set1_epi8(alphaBits)), zero)) & 0xFFFF;
+    *delim = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(bits, _mm_set1_epi8(delimBits)), zero)) & 0xFFFF;
+    *high = (DWORD)_mm_movemask_epi8(v);
+}
+
+void ClassifyAVX2(const char* block, const UCHAR* loTable, const UCHAR* hiTable, UCHAR alphaBits, UCHAR delimBits, UINT64* alpha, UINT64* delim, UINT64* high) {
+    __m256i nibble = _mm256_set1_epi8(0x0F);
+    __m256i v = _mm256_load_si256((const __m256i*)block);
+    __m256i lo = _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)loTable)), _mm256_and_si256(v, nibble));
+    __m256i hi = _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)hiTable)), _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+    __m256i bits = _mm256_and_si256(lo, hi);
+    __m256i zero = _mm256_setzero_si256();
+    *alpha = ~(UINT64)(DWORD)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(bits, _mm256_set1_epi8(alphaBits)), zero)) & 0xFFFFFFFF;
+    *delim = ~(UINT64)(DWORD)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(bits, _mm256_set1_epi8(delimBits)), zero)) & 0xFFFFFFFF;
+    *high = (DWORD)_mm256_movemask_epi8(v);
+}
+
+void ClassifyAVX512(const char* block, const UCHAR* loTable, const UCHAR* hiTable, UCHAR alphaBits, UCHAR delimBits, UINT64* alpha, UINT64* delim, UINT64* high) {
+    __m512i nibble = _mm512_set1_epi8(0x0F);
+    __m512i v = _mm512_load_si512((const void*)block);
+    __m512i lo = _mm512_shuffle_epi8(_mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i*)loTable)), _mm512_and_si512(v, nibble));
+    __m512i hi = _mm512_shuffle_epi8(_mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i*)hiTable)), _mm512_and_si512(_mm512_srli_epi16(v, 4), nibble));
+    __m512i bits = _mm512_and_si512(lo, hi);
+    *alpha = _mm512_test_epi8_mask(bits, _mm512_set1_epi8(alphaBits));
+    *delim = _mm512_test_epi8_mask(bits, _mm512_set1_epi8(delimBits));
+    *high = _mm512_movepi8_mask(v);
+}
+
+// Highest kernel both the CPU and the OS support; the OS has to save the YMM/ZMM state.
+int DetectSimdLevel() {
+    int info[4];
+    __cpuid(info, 0);
+    int maxLeaf = info[0];
+
+    __cpuid(info, 1);
+    bool ssse3 = (info[2] & (1 << 9)) != 0;
+    bool sse42 = (info[2] & (1 << 20)) != 0;
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    UINT64 xcr0 = osxsave ? _xgetbv(0) : 0;
+
+    int features = 0;
+    if (maxLeaf >= 7) {
+        __cpuidex(info, 7, 0);
+        features = info[1];
+    }
+    bool avx2 = (features & (1 << 5)) != 0;
+    bool avx512 = (features & (1 << 16)) != 0 && (features & (1 << 30)) != 0; // F and BW
+
+    if (avx512 && (xcr0 & 0xE6) == 0xE6) {
+        return SIMD_AVX512;
+    }
+    if (avx2 && (xcr0 & 0x6) == 0x6) {
+        return SIMD_AVX2;
+    }
+    if (sse42 && ssse3) {
+        return SIMD_SSE42;
+    }
+    return SIMD_SCALAR;
+}
+
+// name of a tag or entity as the filter reads it, cut off at FILTER_NAME_MAX
+class MarkupName {
+public:
+    char s[FILTER_NAME_MAX + 1];
+    int len;
+    bool closing; // </name>
+    bool done; // the name has ended, attributes follow
+    bool selfClosing; // the last byte before '>' was '/'
+
+    void Start() {
+        len = 0;
+        s[0] = '\0';
+        closing = false;
+        done = false;
+        selfClosing = false;
+    }
+
+    // tag names only; entity names are added byte by byte
+    void Add(UCHAR c) {
+        if (len == 0 && !closing && c == '/') {
+            closing = true;
+        }
+        else if (!done && isalnum(c) && len < FILTER_NAME_MAX) {
+            s[len++] = c;
+            s[len] = '\0';
+        }
+        else {
+            done = true;
+        }
+        selfClosing = c == '/';
+    }
+
+    bool Is(const char* name) const {
+        return (int)strlen(name) == len && _strnicmp(s, name, len) == 0;
+    }
+
+    bool In(const char* const* names) const {
+        for (int i = 0; names[i] != nullptr; i++) {
+            if (Is(names[i])) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+// strips MediaWiki markup in place, one output byte per input byte, with state running across chunks
+class MarkupFilter {
+public:
+    UINT64 pos; // bytes fed since Reset
+    char* base; // chunk being filtered and the position of its first byte
+    UINT64 basePos;
+    char* back; // the chunk in front of it, which ends right before base, or nullptr
+    DWORD backLen;
+    bool special[256]; // bytes that may change the state of plain text
+
+    int xml;
+    MarkupName xmlName;
+    int dropDepth; // inside metadata elements, whose text is not article text
+
+    int templateDepth;
+    char pending; // '{', '}', '[' or ']' waiting to see whether it is doubled
+    int linkDepth;
+    bool linkTarget; // before the '|' of [[target|label]]
+    bool linkSkip; // a file, category or interlanguage link, skipped with the links nested in it
+    UINT64 linkStart;
+    char prefix[FILTER_NAME_MAX]; // link target up to a ':'
+    int prefixLen;
+    bool prefixLower;
+    int ext;
+    UINT64 extStart;
+    char extBuf[8];
+    int extLen;
+    bool wikiTag; // inside <...> of the wikitext, which the dump writes as &lt;...&gt;
+    DWORD tagLen;
+    DWORD bang; // bytes of "!--" matched right after the '<'
+    MarkupName tagName;
+    bool skipping; // inside an element whose content is not text, like <ref> or <math>
+    MarkupName skipName;
+    bool inComment;
+    int dashes;
+    bool wikiEntity;
+    MarkupName entName;
+
+    MarkupFilter() {
+        memset(special, 0, sizeof(special));
+        const char* bytes = "<&[]{}|=";
+        for (const char* b = bytes; *b; b++) {
+            special[(UCHAR)*b] = true;
+        }
+        Reset();
+    }
+
+    void Reset() {
+        pos = 0;
+        xml = XML_TEXT;
+        dropDepth = 0;
+        ResetWiki();
+    }
+
+    // every page's wikitext starts clean, so markup left open cannot swallow the pages after it
+    void ResetWiki() {
+        templateDepth = 0;
+        pending = 0;
+        linkDepth = 0;
+        linkTarget = false;
+        linkSkip = false;
+        ext = EXT_NONE;
+        wikiTag = false;
+        skipping = false;
+        inComment = false;
+        wikiEntity = false;
+    }
+
+    // filters chunk[from, to); bytes before from and those of prev may still be blanked
+    void Run(char* chunk, DWORD from, DWORD to, char* prev, DWORD prevLen) {
+        base = chunk;
+        basePos = pos - from;
+        back = prev;
+        backLen = prev != nullptr ? prevLen : 0;
+        DWORD i = from;
+        while (i < to) {
+            if (xml == XML_TEXT && dropDepth > 0) {
+                char* lt = (char*)memchr(chunk + i, '<', to - i);
+                DWORD n = lt == nullptr ? to - i : (DWORD)(lt - (chunk + i));
+                memset(chunk + i, ' ', n);
+                i += n;
+                pos += n;
+            }
+            else if (xml == XML_TEXT && Plain() && linkDepth == 0 && ext == EXT_NONE) {
+                // most of an article is text that passes as it is
+                DWORD start = i;
+                while (i < to && !special[(UCHAR)chunk[i]]) {
+                    i++;
+                }
+                pos += i - start;
+            }
+            if (i < to) {
+                chunk[i] = Xml((UCHAR)chunk[i]);
+                i++;
+                pos++;
+            }
+        }
+    }
+
+    // wikitext that shows as text, nothing open that would hide it
+    bool Plain() const {
+        return !inComment && !wikiTag && !wikiEntity && !skipping && !linkSkip && templateDepth == 0 && pending == 0 && ext != EXT_URL;
+    }
+
+    // where an earlier byte still is, if anywhere
+    char* At(UINT64 p) {
+        if (p >= basePos) {
+            return base + (p - basePos);
+        }
+        if (basePos - p <= backLen) {
+            return back + backLen - (basePos - p);
+        }
+        return nullptr;
+    }
+
+    void BlankBack(UINT64 from) {
+        UINT64 start = from > basePos ? from : basePos;
+        if (start < pos) {
+            memset(base + (start - basePos), ' ', pos - start);
+        }
+        UINT64 backPos = basePos - backLen;
+        start = from > backPos ? from : backPos;
+        if (start < basePos) {
+            memset(back + (start - backPos), ' ', basePos - start);
+        }
+    }
+
+    // puts back the '&' and name of something that was not an entity after all
+    void Restore(const MarkupName& n) {
+        for (int k = 0; k <= n.len; k++) {
+            char* b = At(pos - n.len - 1 + k);
+            if (b != nullptr) {
+                *b = k == 0 ? '&' : n.s[k - 1];
+            }
+        }
+    }
+
+    static UCHAR EntityChar(const MarkupName& n) {
+        const char* names[] = { "amp", "lt", "gt", "quot", "apos" };
+        const char chars[] = { '&', '<', '>', '"', '\'' };
+        for (int i = 0; i < 5; i++) {
+            if (strcmp(n.s, names[i]) == 0) {
+                return chars[i];
+            }
+        }
+        if (n.len > 1 && n.s[0] == '#') {
+            bool hex = n.s[1] == 'x' || n.s[1] == 'X';
+            unsigned long v = strtoul(n.s + (hex ? 2 : 1), nullptr, hex ? 16 : 10);
+            if (v > 0 && v < 0x80) {
+                return (UCHAR)v;
+            }
+        }
+        // named characters outside ASCII (nbsp, ndash, ...) only separate words
+        return ' ';
+    }
+
+    static bool AddEntityByte(MarkupName& n, UCHAR c) {
+        if ((!isalnum(c) && !(c == '#' && n.len == 0)) || n.len == FILTER_NAME_MAX) {
+            return false;
+        }
+        n.s[n.len++] = c;
+        n.s[n.len] = '\0';
+        return true;
+    }
+
+    UCHAR Xml(UCHAR c) {
+        if (xml == XML_TAG) {
+            if (c == '>') {
+                xml = XML_TEXT;
+                EndXmlTag();
+            }
+            else {
+                xmlName.Add(c);
+            }
+            return ' ';
+        }
+        if (xml == XML_ENTITY) {
+            if (c == ';') {
+                xml = XML_TEXT;
+                return dropDepth > 0 ? ' ' : Wiki(EntityChar(xmlName));
+            }
+            if (AddEntityByte(xmlName, c)) {
+                return ' ';
+            }
+            // a bare '&' never comes out of a dump, but plain text has them
+            xml = XML_TEXT;
+            if (dropDepth == 0 && Plain()) {
+                Restore(xmlName);
+            }
+        }
+        if (c == '<') {
+            xml = XML_TAG;
+            xmlName.Start();
+            return ' ';
+        }
+        if (c == '&') {
+            xml = XML_ENTITY;
+            xmlName.Start();
+            return ' ';
+        }
+        return dropDepth > 0 ? ' ' : Wiki(c);
+    }
+
+    void EndXmlTag() {
+        static const char* const dropped[] = { "siteinfo", "ns", "id", "parentid", "timestamp", "contributor", "comment",
+            "model", "format", "sha1", "origin", "restrictions", nullptr };
+        if (xmlName.Is("text")) {
+            ResetWiki();
+        }
+        else if (xmlName.In(dropped)) {
+            if (xmlName.closing) {
+                if (dropDepth > 0) {
+                    dropDepth--;
+                }
+            }
+            else if (!xmlName.selfClosing) {
+                dropDepth++;
+            }
+        }
+    }
+
+    UCHAR Wiki(UCHAR c) {
+        if (inComment) {
+            if (c == '>' && dashes >= 2) {
+                inComment = false;
+            }
+            dashes = c == '-' ? dashes + 1 : 0;
+            return ' ';
+        }
+        if (wikiTag) {
+            return WikiTag(c);
+        }
+        if (wikiEntity) {
+            if (c == ';') {
+                wikiEntity = false;
+                return EntityChar(entName);
+            }
+            if (AddEntityByte(entName, c)) {
+                return ' ';
+            }
+            wikiEntity = false;
+            Restore(entName);
+        }
+        if (skipping) {
+            // only the closing tag matters
+            if (c == '<') {
+                StartWikiTag();
+            }
+            return ' ';
+        }
+
+        char twin = pending;
+        pending = 0;
+        if (twin == '{' && c == '{') {
+            templateDepth++;
+            return ' ';
+        }
+        if (twin == '}' && c == '}') {
+            if (templateDepth > 0) {
+                templateDepth--;
+            }
+            return ' ';
+        }
+        if (templateDepth > 0) {
+            if (c == '{' || c == '}') {
+                pending = c;
+            }
+            else if (c == '<') {
+                StartWikiTag();
+            }
+            return ' ';
+        }
+        if (twin == '[' && c == '[') {
+            if (++linkDepth == 1) {
+                linkTarget = true;
+                linkStart = pos - 1;
+                prefixLen = 0;
+                prefixLower = true;
+            }
+            ext = EXT_NONE;
+            return ' ';
+        }
+        if (twin == ']' && c == ']') {
+            if (linkDepth > 0 && --linkDepth == 0) {
+                linkTarget = false;
+                linkSkip = false;
+            }
+            return ' ';
+        }
+        if (c == '\n') {
+            // links and external links never run past the end of a line
+            linkDepth = 0;
+            linkTarget = false;
+            linkSkip = false;
+            ext = EXT_NONE;
+        }
+        if (linkSkip) {
+            if (c == '[' || c == ']') {
+                pending = c;
+            }
+            return ' ';
+        }
+        if (twin == '[' && linkDepth == 0 && ext == EXT_NONE) {
+            ext = EXT_PREFIX;
+            extStart = pos - 1;
+            extLen = 0;
+        }
+        if (ext == EXT_PREFIX) {
+            extBuf[extLen++] = (char)tolower(c);
+            const char* urls[] = { "http://", "https://", "//" };
+            bool prefixOfUrl = false;
+            for (int i = 0; i < 3; i++) {
+                int n = (int)strlen(urls[i]);
+                if (extLen <= n && strncmp(extBuf, urls[i], extLen) == 0) {
+                    if (extLen == n) {
+                        BlankBack(extStart);
+                        ext = EXT_URL;
+                        return ' ';
+                    }
+                    prefixOfUrl = true;
+                }
+            }
+            if (prefixOfUrl) {
+                return c;
+            }
+            ext = EXT_NONE;
+        }
+        if (ext == EXT_URL) {
+            if (c == ' ') {
+                ext = EXT_LABEL;
+            }
+            else if (c == ']') {
+                ext = EXT_NONE;
+            }
+            return ' ';
+        }
+        if (ext == EXT_LABEL && c == ']') {
+            ext = EXT_NONE;
+            return ' ';
+        }
+        if (linkTarget) {
+            if (c == '|') {
+                BlankBack(linkStart);
+                linkTarget = false;
+                return ' ';
+            }
+            if (c == ':' && IsSkippedNamespace()) {
+                BlankBack(linkStart);
+                linkSkip = true;
+                return ' ';
+            }
+            if (prefixLen >= 0) {
+                if (isalpha(c) && prefixLen < FILTER_NAME_MAX) {
+                    prefixLower = prefixLower && islower(c);
+                    prefix[prefixLen++] = c;
+                }
+                else {
+                    prefixLen = -1; // not a namespace any more
+                }
+            }
+        }
+
+        switch (c) {
+        case '{':
+        case '}':
+        case '[':
+        case ']':
+            pending = c;
+            return ' ';
+        case '|':
+        case '=':
+            return ' ';
+        case '<':
+            StartWikiTag();
+            return ' ';
+        case '&':
+            wikiEntity = true;
+            entName.Start();
+            return ' ';
+        }
+        return c;
+    }
+
+    // [[File:...]], [[Category:...]] and [[de:...]] do not show as text where they stand
+    bool IsSkippedNamespace() const {
+        static const char* const names[] = { "file", "image", "category", "media", nullptr };
+        if (prefixLen <= 0) {
+            return false;
+        }
+        if (prefixLower && prefixLen <= 3 && prefixLen >= 2) {
+            return true;
+        }
+        for (int i = 0; names[i] != nullptr; i++) {
+            if ((int)strlen(names[i]) == prefixLen && _strnicmp(prefix, names[i], prefixLen) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void StartWikiTag() {
+        wikiTag = true;
+        tagLen = 0;
+        bang = 0;
+        tagName.Start();
+    }
+
+    UCHAR WikiTag(UCHAR c) {
+        tagLen++;
+        if (tagLen == 1 && !isalpha(c) && c != '/' && c != '!') {
+            // "x < y": the '<' was text
+            wikiTag = false;
+            return Wiki(c);
+        }
+        if (bang == tagLen - 1 && bang < 3 && c == "!--"[bang]) {
+            if (++bang == 3) {
+                wikiTag = false;
+                inComment = true;
+                dashes = 0;
+            }
+            return ' ';
+        }
+        if (c == '>') {
+            wikiTag = false;
+            EndWikiTag();
+            return ' ';
+        }
+        if (tagLen > FILTER_TAG_MAX && c < 0x80) {
+            wikiTag = false;
+            return Wiki(c);
+        }
+        tagName.Add(c);
+        return ' ';
+    }
+
+    void EndWikiTag() {
+        static const char* const skipped[] = { "ref", "math", "chem", "ce", "gallery", "timeline", "score", "source",
+            "syntaxhighlight", "hiero", "graph", "mapframe", "imagemap", "templatedata", nullptr };
+        if (skipping) {
+            if (tagName.closing && tagName.Is(skipName.s)) {
+                skipping = false;
+            }
+        }
+        else if (!tagName.closing && !tagName.selfClosing && tagName.In(skipped)) {
+            skipping = true;
+            skipName = tagName;
+        }
+    }
+};
+
+// tables of the UTF-8 tokenizer, also used to fold the queries of LookupMain
+void BuildWideTables(UCHAR* wideClassLUT, WORD* wideLowerLUT);
+DWORD FoldWord(const WORD* wideLowerLUT, const char* word, DWORD len, char* out);
+
+class MainThreadClass {
+public:
+    HANDLE terminateEvent;
+    HANDLE timerEvent;
+    CRITICAL_SECTION cs;
+    CPU cpu;
+    MersenneTwister mt;
+
+    PC* pcEmpty;
+    PC* pcFull;
+    PC* pcRaw; // filled slots on their way to the markup filter stage
+    PC** pcNear; // filled slots by the node their memory is on; pcNear[0] is pcFull
+    int nNodes; // NUMA nodes the workers and slots are spread over, 1 without PLACE_NUMA
+    int placement;
+
+    UINT64 fileSize; // all inputs together
+    std::vector<InputFile> inputs;
+    DWORD lenLongestWord = 32;
+    DWORD lookBehind = 0; // bytes in front of the shadow the UTF-8 tokenizer may read back into
+    volatile DWORD nSlots = 0; // grows while tuning
+    DWORD maxSlots = 0;
+    UINT64 slotSize = 0;
+    volatile DWORD B = 0; // changes while tuning the sync reader
+    int chunkExp = 0;
+    DWORD sectorSize = 0;
+    int shadowSize = 0;
+    int padding = 0;
+
+    int readerMode;
+    int queueDepth;
+    int nReaders;
+    int cachePolicy;
+    int filterMode;
+    DWORD cacheFlags; // CreateFile flags for the readers that go through the file cache
+
+    std::unordered_map<UINT64, ChunkEdge> edges; // edges still waiting for one side
+    CRITICAL_SECTION edgeCs;
+
+    char* indexName;
+    PC* pcStreams; // stream ranges waiting for a decoder
+    UINT64 nStreams = 0;
+    UINT64 decompressedBytes = 0;
+
+    UINT64 nChunks = 0; // over all inputs, for the readers that number chunks up front
+    volatile LONG64 nextChunk = 0;
+    volatile LONG64 chunksDone = 0;
+    HANDLE rangesDone;
+
+    // the final merge: once the last worker is out of chunks, all of them take shards by turns
+    int nWorkers;
+    std::vector<TableShards*> workerShards;
+    int countingWorkers; // workers still counting chunks
+    int mergingWorkers; // workers still merging
+    volatile LONG nextShard = 0;
+    HANDLE mergeEvent;
+
+    char* mega_buf;
+
+    bool autoTune;
+    volatile LONG64 idleTicks = 0; // time consumers spent waiting for a full slot
+    volatile LONG64 stallTicks = 0; // time readers spent waiting for an empty slot
+
+    FILE* file;
+
+    int activeThreads = 0;
+    UINT64 totalBytesRead = 0;
+    UINT64 totalMatches = 0;
+
+    UINT64 total_words = 0;
+    UINT64 unique_words = 0;
+    UINT64 invalid_words = 0;
+
+    UINT64 num_lookups;
+    UINT64 lookup_depth;
+    UINT64 max_lookup_depth;
+
+    char isalphaLUT[256];
+    char isdelimiterLUT[256];
+    UINT64 sboxLUT[256];
+    int hashMode;
+    UINT64 mixKeys[10]; // lane and finalizer keys of HASH_MIX
+    bool packedKeys; // KEYS_PACKED, which only ASCII words fit
+    int tableEngine;
+    int insertBatch;
+    int countMode;
+    int heavyCounters; // Space-Saving counters per worker under COUNT_HEAVY, 0 otherwise
+
+    bool utf8;
+    UCHAR wideClassLUT[0x800]; // class of every two-byte code point
+    WORD wideLowerLUT[0x800]; // its lower-case form
+
+    int simdLevel;
+    DWORD simdWidth; // bytes per classified block
+    ClassifyFn classify;
+    UCHAR loNibbleLUT[16];
+    UCHAR hiNibbleLUT[16];
+    UCHAR alphaBits; // class bits of the letters in the nibble tables
+    UCHAR delimBits;
+
+    TableShards* main_shards;
+
+    LONGLONG init_mergeTime;
+    LONGLONG final_mergeTime;
+
+    int nB;
+    int nShards;
+
+    MainThreadClass(int nBin, int workers, RunConfig& cfg, FILE* f) {
+        terminateEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+        timerEvent = CreateEvent(NULL, TRUE, TRUE, NULL);
+        rangesDone = CreateEvent(NULL, TRUE, FALSE, NULL);
+        mergeEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+        InitializeCriticalSection(&cs);
+        InitializeCriticalSection(&edgeCs);
+
+        if (terminateEvent == NULL)
+        {
+            printf("CreateEvent error: %d\n", GetLastError());
+            exit(-1);
+        }
+
+        if (timerEvent == NULL || rangesDone == NULL || mergeEvent == NULL)
+        {
+            printf("CreateEvent error: %d\n", GetLastError());
+            exit(-1);
+        }
+
+        file = f;
+        if (cfg.pages == PAGES_LARGE) {
+            tablePages.EnableLargePages();
+        }
+        placement = cfg.placement;
+        if (placement == PLACE_NUMA) {
+            numa.Load();
+        }
+        nNodes = placement == PLACE_NUMA ? numa.nNodes : 1;
+        tablePages.perNode = nNodes > 1;
+        utf8 = cfg.charset == CHARSET_UTF8;
+        lenLongestWord = utf8 ? LONGEST_WORD_UTF8 : 32;
+        lookBehind = utf8 ? 3 : 0;
+        countMode = cfg.countMode;
+        // the sketch takes the word hash the tokenizer makes anyway
+        packedKeys = cfg.keyMode == KEYS_PACKED && !utf8 && countMode != COUNT_ESTIMATE;
+        tableEngine = cfg.tableEngine;
+        insertBatch = cfg.insertBatch;
+        heavyCounters = countMode == COUNT_HEAVY ? cfg.heavyCounters : 0;
+        readerMode = cfg.readerMode;
+        queueDepth = cfg.queueDepth;
+        nReaders = cfg.nReaders;
+        indexName = cfg.indexName;
+        cachePolicy = cfg.cachePolicy;
+        filterMode = cfg.filterMode;
+        if (filterMode != FILTER_NONE && readerMode == READER_MAPPED) {
+            // the filter rewrites chunks in place, and the view is read-only
+            readerMode = READER_SYNC;
+        }
+        cacheFlags = cachePolicy == CACHE_STREAM ? FILE_FLAG_SEQUENTIAL_SCAN : FILE_ATTRIBUTE_NORMAL;
+
+        autoTune = cfg.autoTune;
+        nSlots = cpu.cpus + 5; // num slots to maintain
+        // the tuner may add slots later, so the queues are sized for the most it will use
+        maxSlots = autoTune ? 2 * nSlots : nSlots;
+        pcEmpty = new PC(terminateEvent, maxSlots, sizeof(int));
+        pcFull = new PC(terminateEvent, maxSlots, sizeof(MyBuf));
+        // bzip2 decoders filter what they decompress themselves, the other readers go through the filter stage
+        pcRaw = filterMode != FILTER_NONE && readerMode != READER_BZIP2 ? new PC(terminateEvent, maxSlots, sizeof(MyBuf)) : nullptr;
+        pcNear = new PC*[nNodes];
+        pcNear[0] = pcFull;
+        for (int i = 1; i < nNodes; i++) {
+            pcNear[i] = new PC(terminateEvent, maxSlots, sizeof(MyBuf));
+        }
+        if (readerMode == READER_BZIP2 && nReaders > (int)nSlots - 1) {
+            // every decoder may hold a filled slot while it waits for the next one
+            nReaders = nSlots - 1;
+        }
+        pcStreams = new PC(terminateEvent, 2 * nReaders, sizeof(StreamRange));
+
+        GetDiskFreeSpace(NULL, NULL, &sectorSize, NULL, NULL);
+        if (readerMode == READER_OVERLAPPED && sectorSize < IO_ALIGN) {
+            // the file may sit on a volume with larger sectors than the working directory
+            sectorSize = IO_ALIGN;
+        }
+        shadowSize = ((lenLongestWord + lookBehind) / sectorSize + 1) * sectorSize;
+        padding = shadowSize + sectorSize; // both shadow buffers
+        chunkExp = cfg.bufExp;
+        B = 1 << cfg.bufExp; // 1MB in each slot
+        if (readerMode == READER_OVERLAPPED && B < sectorSize) {
+            printf("Overlapped reader needs buf_size of at least %d bytes\n", sectorSize);
+            exit(-1);
+        }
+
+        for (int i = 0; i < 256; ++i) {
+            isalphaLUT[i] = 0;
+            isdelimiterLUT[i] = 0;
+        }
+        
+        for (char c = 'a'; c <= 'z'; ++c) {
+            isalphaLUT[c] = 1;
+        }
+        
+        for (char c = 'A'; c <= 'Z'; ++c) {
+            isalphaLUT[c] = 1;
+        }
+
+        isdelimiterLUT['\0'] = 1;
+        isdelimiterLUT[' '] = 1;
+        isdelimiterLUT[','] = 1;
+        isdelimiterLUT['\n'] = 1;
+        isdelimiterLUT['\r'] = 1; 
+        isdelimiterLUT['.'] = 1;
+        isdelimiterLUT['\''] = 1;
+        isdelimiterLUT['"'] = 1;
+        isdelimiterLUT['?'] = 1;
+        isdelimiterLUT['-'] = 1;
+        isdelimiterLUT[':'] = 1;
+        isdelimiterLUT[';'] = 1;
+        isdelimiterLUT['*'] = 1;
+        isdelimiterLUT['!'] = 1;
+        isdelimiterLUT['\t'] = 1;
+
+        for (int i = 0; i < 256; i++) {
+            sboxLUT[i] = mt.genrand64_int64();
+        }
+
+        for (char c = 'A'; c <= 'Z'; ++c) {
+            sboxLUT[c] = sboxLUT[c + 32];
+        }
+
+        BuildWideTables(wideClassLUT, wideLowerLUT);
+
+        hashMode = cfg.hashMode;
+        for (int i = 0; i < 10; i++) {
+            mixKeys[i] = mt.genrand64_int64();
+        }
+
+        simdLevel = DetectSimdLevel();
+        if (simdLevel > cfg.simdLevel) {
+            simdLevel = cfg.simdLevel;
+        }
+        if (!BuildNibbleTables()) {
+            simdLevel = SIMD_SCALAR;
+        }
+        ClassifyFn kernels[] = { nullptr, ClassifySSE42, ClassifyAVX2, ClassifyAVX512 };
+        DWORD widths[] = { 1, 16, 32, 64 };
+        classify = kernels[simdLevel];
+        simdWidth = widths[simdLevel];
+
+        OpenInputs(cfg);
+        // mapping needs isalphaLUT to check the tail of each file
+        if (readerMode == READER_MAPPED) {
+            MapInput();
+        }
+        // shadow-based readers end every file with a chunk that may be empty, the stitching ones do not
+        LayoutChunks(readerMode == READER_OVERLAPPED || readerMode == READER_MAPPED);
+        // VirtualAlloc guarantees page-aligned addresses, while the heap does not
+        if (!autoTune) {
+            slotSize = B + padding; // full slot with padding
+            mega_buf = NULL;
+            if (nNodes > 1) {
+                // each slot is committed on the node of the workers it goes to
+                mega_buf = (char*)VirtualAlloc(NULL, (UINT64)nSlots * slotSize, MEM_RESERVE, PAGE_READWRITE);
+                if (mega_buf != NULL) {
+                    CommitSlots(0, nSlots, B);
+                }
+            }
+            else if (tablePages.largePage != 0) {
+                // the slots never grow, so they can take large pages like the tables
+                mega_buf = (char*)VirtualAlloc(NULL, tablePages.Round((UINT64)nSlots * slotSize), MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES, PAGE_READWRITE);
+            }
+            if (mega_buf == NULL) {
+                mega_buf = (char*)VirtualAlloc(NULL, (UINT64)nSlots * slotSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+            }
+        }
+        else {
+            // only the sync reader changes B, so slots are spaced for the largest B and committed as used
+            slotSize = (readerMode == READER_SYNC ? 1 << TUNE_MAX_EXP : B) + padding;
+            mega_buf = (char*)VirtualAlloc(NULL, (UINT64)maxSlots * slotSize, MEM_RESERVE, PAGE_READWRITE);
+            if (mega_buf != NULL) {
+                CommitSlots(0, nSlots, B);
+            }
+        }
+        if (mega_buf == NULL) {
+            printf("VirtualAlloc error: %d\n", GetLastError());
+            exit(-1);
+        }
+
+        nB = nBin;
+        nWorkers = workers;
+        countingWorkers = workers;
+        mergingWorkers = workers;
+        // one shard per worker or more, so that each can merge one at the same time
+        nShards = 1;
+        while (tableEngine != TABLE_SHARED && nShards < workers && nShards < MERGE_PARTS_MAX) {
+            nShards *= 2;
+        }
+        if (countMode == COUNT_HEAVY) {
+            // the summaries are small enough for one worker to merge them all
+            nShards = 0;
+            main_shards = new TableShards(new SpaceSaving(heavyCounters, packedKeys));
+        }
+        else if (countMode == COUNT_ESTIMATE) {
+            nShards = 0;
+            main_shards = new TableShards(new HyperLogLog());
+        }
+        else {
+            // every worker and the result have nShards arenas, which split the reserved address space
+            UINT64 arenas = (UINT64)(workers + 1) * nShards;
+            if (ARENA_SPACE / arenas < tablePages.arenaSpan) {
+                tablePages.arenaSpan = ARENA_SPACE / arenas & ~(UINT64)(SMALL_PAGE - 1);
+            }
+            main_shards = new TableShards(nShards, nB, packedKeys, tableEngine, nullptr);
+        }
+    };
+
+    void ProcessData(int worker);
+    void OpenInputs(RunConfig& cfg);
+    void LayoutChunks(bool trailingEmpty);
+    int FileOfChunk(UINT64 chunk);
+    void DiskRead();
+    void DiskReadOverlapped();
+    void DiskReadParallel();
+    void ReadChunks();
+    void DiskReadBzip2();
+    void FilterChunks();
+    void FilterChunk(MyBuf* cb, MyBuf* prev, MarkupFilter* filter);
+    char* ChunkData(MyBuf* cb);
+    void DecodeStreams();
+    void ScanStreams(HANDLE hFile, int fileID, StreamRange* r);
+    void LoadStreamIndex(std::vector<UINT64>& starts);
+    void MapInput();
+    int GetChunk(MyBuf* cb, int node);
+    int TakeFull(MyBuf* cb, int node, DWORD ms);
+    void ProduceFull(MyBuf* mb);
+    void ProduceRead(MyBuf* mb);
+    void ReleaseChunk(MyBuf* cb);
+    int TakeSlot(int* slotID);
+    void LowerMemoryPriority();
+    void CommitSlots(DWORD from, DWORD to, DWORD chunk);
+    void Tune();
+    void FrameSlot(int slotID, DWORD bytesRead, UINT64 seq, bool first, bool last, UINT64 off, int fileID, MyBuf* mb);
+    void FrameStitched(int slotID, DWORD lead, DWORD bytes, UINT64 seq, UINT64 nextSeq, bool first, bool last, UINT64 off, int fileID, MyBuf* mb);
+    int SplitEdges(MyBuf* cb, TableShards* ht, DWORD* t_words, DWORD* i_words);
+    void StitchEdge(UINT64 key, WordFragment* frag, bool left, TableShards* ht, DWORD* t_words, DWORD* i_words);
+    void CountWord(TableShards* ht, UINT64 hashKey, char* word, DWORD wordLen);
+    void BatchWord(InsertBatch* b, TableShards* ht, UINT64 hashKey, char* word, DWORD wordLen, bool copy);
+    void FlushBatch(InsertBatch* b);
+    void MergeShards();
+    void TrackStats();
+
+    bool BuildNibbleTables();
+    void Classify(TokenCursor* tc, const char* p);
+    bool IsDelimiter(TokenCursor* tc, const char* p);
+    int FindNextWordStart(MyBuf cb, int off, DWORD* wordStart, TokenCursor* tc);
+    int FindThisWordEnd(MyBuf cb, DWORD wordStart, DWORD* wordEnd, UINT64* hashKey, TokenCursor* tc);
+    UINT64 HashWord(const char* word, DWORD len);
+    bool WordIsEligible(MyBuf cb, DWORD wordStart, DWORD wordEnd, TokenCursor* tc);
+
+    int DecodeChar(const char* p, int* cls, WORD* cp);
+    int DecodeCharBefore(const char* p, int* cls);
+    DWORD FoldWord(const char* word, DWORD len, char* out) {
+        return ::FoldWord(wideLowerLUT, word, len, out);
+    }
+    DWORD SplitCharBytes(const char* data, DWORD len);
+    DWORD SkipLetters(char* buf, DWORD curr, TokenCursor* tc);
+    int FindNextWordStartUtf8(MyBuf cb, int off, DWORD* wordStart, TokenCursor* tc);
+    int FindThisWordEndUtf8(MyBuf cb, DWORD wordStart, DWORD* wordEnd, UINT64* hashKey, TokenCursor* tc);
+    bool WordIsEligibleUtf8(MyBuf cb, DWORD wordStart, DWORD wordEnd, TokenCursor* tc);
+};
+
+// Opens every input once to learn its size; the readers open them again in the mode they need.
+void MainThreadClass::OpenInputs(RunConfig& cfg) {
+    fileSize = 0;
+    for (size_t i = 0; i < cfg.inputs.size(); i++) {
+        HANDLE hFile = CreateFile(cfg.inputs[i], GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hFile == INVALID_HANDLE_VALUE) {
+            printf("CreateFile error %d on %s\n", GetLastError(), cfg.inputs[i]);
+            exit(-1);
+        }
+
+        DWORD high, low = GetFileSize(hFile, &high);
+        if (low == INVALID_FILE_SIZE) {
+            printf("GetFileSize error: %d\n", GetLastError());
+            exit(-1);
+        }
+        CloseHandle(hFile);
+
+        InputFile in;
+        memset(&in, 0, sizeof(InputFile));
+        in.name = cfg.inputs[i];
+        in.size = ((UINT64)high << 32) + low;
+        inputs.push_back(in);
+        fileSize += in.size;
+    }
+}
+
+// numbers the chunks of all inputs in a row, with a trailing empty chunk when the reader needs one
+void MainThreadClass::LayoutChunks(bool trailingEmpty) {
+    nChunks = 0;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        UINT64 size = inputs[i].size;
+        inputs[i].firstChunk = nChunks;
+        if (trailingEmpty) {
+            inputs[i].nChunks = size / B + 1;
+        }
+        else {
+            inputs[i].nChunks = size == 0 ? 1 : (size + B - 1) / B;
+        }
+        nChunks += inputs[i].nChunks;
+    }
+}
+
+int MainThreadClass::FileOfChunk(UINT64 chunk) {
+    int lo = 0;
+    int hi = (int)inputs.size() - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (inputs[mid].firstChunk <= chunk) {
+            lo = mid;
+        }
+        else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+// sets up the consumer view of a filled slot; the lenLongestWord bytes in front hold the previous tail
+void MainThreadClass::FrameSlot(int slotID, DWORD bytesRead, UINT64 seq, bool first, bool last, UINT64 off, int fileID, MyBuf* mb) {
+    char* currBuf = mega_buf + ((UINT64)slotID * slotSize);
+
+    if (first) {
+        mb->ptr = currBuf + shadowSize;
+        mb->size = last ? bytesRead + 1 : bytesRead - lenLongestWord + 1;
+        mb->ptr[-1] = '\0';
+    }
+    else {
+        mb->ptr = currBuf + shadowSize - lenLongestWord;
+        mb->size = last ? bytesRead + lenLongestWord : bytesRead + 1;
+    }
+    mb->first = first;
+    mb->last = last;
+    mb->stitch = false;
+    mb->slotID = slotID;
+    mb->bytes = bytesRead;
+    mb->offset = off;
+    mb->seq = seq;
+    mb->nextSeq = seq + 1;
+    mb->fileID = fileID;
+
+    char* nullCharSlot = currBuf + shadowSize + bytesRead;
+    *nullCharSlot = '\0';
+}
+
+// sets up a slot whose edge words go to SplitEdges; its first lead bytes finish the previous character
+void MainThreadClass::FrameStitched(int slotID, DWORD lead, DWORD bytes, UINT64 seq, UINT64 nextSeq, bool first, bool last, UINT64 off, int fileID, MyBuf* mb) {
+    mb->ptr = mega_buf + ((UINT64)slotID * slotSize) + shadowSize + lead;
+    mb->size = bytes;
+    mb->ptr[-1] = '\0';
+    mb->ptr[bytes] = '\0';
+    mb->slotID = slotID;
+    mb->bytes = bytes;
+    mb->offset = off;
+    mb->stitch = true;
+    mb->first = first;
+    mb->last = last;
+    mb->seq = seq;
+    mb->nextSeq = nextSeq;
+    mb->fileID = fileID;
+}
+
+DWORD WINAPI FilterThread(LPVOID p) {
+    ((MainThreadClass*)p)->FilterChunks();
+    return 0;
+}
+
+void MainThreadClass::DiskRead() {
+    LowerMemoryPriority();
+
+    if (pcRaw != nullptr) {
+        // the filter stage quits on terminateEvent like the workers
+        HANDLE filter = CreateThread(NULL, 0, FilterThread, this, 0, NULL);
+        if (filter == NULL) {
+            printf("(-) Error %d creating thread.", GetLastError());
+            exit(-1);
+        }
+        CloseHandle(filter);
+    }
+
+    if (readerMode == READER_BZIP2) {
+        DiskReadBzip2();
+        return;
+    }
+
+    if (readerMode == READER_OVERLAPPED) {
+        DiskReadOverlapped();
+        return;
+    }
+
+    if (readerMode == READER_PARALLEL) {
+        DiskReadParallel();
+        return;
+    }
+
+    if (readerMode == READER_MAPPED) {
+        // the workers pull ranges themselves; just wait for the last one to come back
+        WaitForSingleObject(rangesDone, INFINITE);
+        init_mergeTime = getTime();
+        SetEvent(terminateEvent);
+        return;
+    }
+
+    DWORD shadowCopy = lenLongestWord + lookBehind;
+    char* prevShadowBuffer = (char*)malloc(shadowCopy);
+
+    for (int i = 0; i < nSlots; i++) {
+        pcEmpty->Produce(&i);
+    }
+
+    totalBytesRead = 0;
+    UINT64 seq = 0;
+
+    // files go through the slots back to back; the first chunk of each one ignores the shadow
+    for (int f = 0; f < (int)inputs.size(); f++) {
+        HANDLE hFile = CreateFile(inputs[f].name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, cacheFlags, NULL);
+        if (hFile == INVALID_HANDLE_VALUE) {
+            printf("CreateFile error: %d\n", GetLastError());
+            exit(-1);
+        }
+
+        bool reachedEof = false;
+        bool first = true;
+        UINT64 off = 0;
+
+        int slotID = 0;
+        while (!reachedEof) {
+            if (TakeSlot(&slotID) == -1) {
+                return;
+            }
+
+            DWORD bytesRead = 0;
+            DWORD chunkSize = B; // the tuner may change B between reads
+            char* currBuf = mega_buf + (slotID * slotSize);
+            if (ReadFile(hFile, currBuf+shadowSize, chunkSize, &bytesRead, NULL) == FALSE) {
+                if (GetLastError() != ERROR_HANDLE_EOF) {
+                    printf("ReadFile error: %d\n", GetLastError());
+                    exit(-1);
+                }
+                reachedEof = true;
+            }
+            else if (bytesRead < chunkSize) {
+                reachedEof = true;
+            }
+
+            EnterCriticalSection(&cs);
+            totalBytesRead += bytesRead;
+            inputs[f].bytes += bytesRead;
+            LeaveCriticalSection(&cs);
+
+            //printf("bytes read: %d\n", bytesRead);
+            memcpy(currBuf + shadowSize - shadowCopy, prevShadowBuffer, shadowCopy);
+            memcpy(prevShadowBuffer, currBuf + shadowSize + chunkSize - shadowCopy, shadowCopy);
+
+            MyBuf mb;
+            FrameSlot(slotID, bytesRead, seq++, first, reachedEof, off, f, &mb);
+            first = false;
+            off += bytesRead;
+
+            ProduceRead(&mb);
+        }
+        CloseHandle(hFile);
+    }
+
+    init_mergeTime = getTime();
+
+    int slot = 0;
+    for (int i = 0; i < nSlots; i++) {
+        pcEmpty->Consume(&slot);
+    }
+    SetEvent(terminateEvent);
+}
+
+// keeps queueDepth unbuffered reads in flight; each slot reads its own shadow, so slots finish in any order
+void MainThreadClass::DiskReadOverlapped() {
+    for (int i = 0; i < nSlots; i++) {
+        pcEmpty->Produce(&i);
+    }
+
+    // every input completes on the same port, so reads of the next file overlap the tail of the previous one
+    HANDLE port = NULL;
+    HANDLE* handles = new HANDLE[inputs.size()];
+    for (size_t f = 0; f < inputs.size(); f++) {
+        handles[f] = CreateFile(inputs[f].name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED, NULL);
+        if (handles[f] == INVALID_HANDLE_VALUE) {
+            printf("CreateFile error: %d\n", GetLastError());
+            exit(-1);
+        }
+
+        port = CreateIoCompletionPort(handles[f], port, f, 1);
+        if (port == NULL) {
+            printf("CreateIoCompletionPort error: %d\n", GetLastError());
+            exit(-1);
+        }
+    }
+
+    DWORD ioSize = B < MAX_IO_SIZE ? B : MAX_IO_SIZE;
+    int readsPerSlot = B / ioSize;
+    ReadRequest* requests = new ReadRequest[maxSlots * readsPerSlot];
+    int* pending = new int[maxSlots];
+    DWORD* slotBytes = new DWORD[maxSlots];
+    UINT64* slotOffset = new UINT64[maxSlots];
+    UINT64* slotSeq = new UINT64[maxSlots];
+    int* slotFile = new int[maxSlots];
+
+    UINT64 nextChunk = 0;
+    int f = 0;
+    int outstanding = 0;
+    totalBytesRead = 0;
+
+    while (nextChunk < nChunks || outstanding > 0) {
+        while (nextChunk < nChunks && (outstanding == 0 || outstanding + readsPerSlot <= queueDepth)) {
+            int slotID;
+            if (outstanding == 0) {
+                if (TakeSlot(&slotID) == -1) {
+                    return;
+                }
+            }
+            else if (pcEmpty->TryConsume(&slotID) != 0) {
+                break;
+            }
+
+            while (nextChunk >= inputs[f].firstChunk + inputs[f].nChunks) {
+                f++;
+            }
+            UINT64 size = inputs[f].size;
+            UINT64 off = (nextChunk - inputs[f].firstChunk) * B;
+            char* currBuf = mega_buf + ((UINT64)slotID * slotSize) + shadowSize;
+            slotOffset[slotID] = off;
+            slotSeq[slotID] = nextChunk;
+            slotFile[slotID] = f;
+            slotBytes[slotID] = 0;
+            pending[slotID] = 0;
+
+            for (int j = 0; j < readsPerSlot; j++) {
+                UINT64 start = off + (UINT64)j * ioSize;
+                DWORD shadow = (j == 0 && off > 0) ? shadowSize : 0;
+                if (start >= size && shadow == 0) {
+                    break;
+                }
+
+                UINT64 len = ioSize + shadow;
+                UINT64 remaining = size - (start - shadow);
+                if (remaining < len) {
+                    len = (remaining + sectorSize - 1) / sectorSize * sectorSize;
+                }
+
+                ReadRequest* r = &requests[slotID * readsPerSlot + j];
+                memset(&r->ov, 0, sizeof(OVERLAPPED));
+                r->ov.Offset = (DWORD)(start - shadow);
+                r->ov.OffsetHigh = (DWORD)((start - shadow) >> 32);
+                r->slotID = slotID;
+                r->shadowBytes = shadow;
+
+                if (ReadFile(handles[f], currBuf + (UINT64)j * ioSize - shadow, (DWORD)len, NULL, &r->ov) == FALSE && GetLastError() != ERROR_IO_PENDING) {
+                    printf("ReadFile error: %d\n", GetLastError());
+                    exit(-1);
+                }
+                pending[slotID]++;
+                outstanding++;
+            }
+            nextChunk++;
+
+            if (pending[slotID] == 0) {
+                // only an empty file gets here: its single chunk has nothing to read
+                MyBuf mb;
+                FrameSlot(slotID, 0, slotSeq[slotID], true, true, 0, f, &mb);
+                ProduceRead(&mb);
+            }
+        }
+
+        if (outstanding == 0) {
+            continue;
+        }
+
+        DWORD bytes = 0;
+        ULONG_PTR key;
+        OVERLAPPED* ov = NULL;
+        if (GetQueuedCompletionStatus(port, &bytes, &key, &ov, INFINITE) == FALSE) {
+            if (ov == NULL || GetLastError() != ERROR_HANDLE_EOF) {
+                printf("GetQueuedCompletionStatus error: %d\n", GetLastError());
+                exit(-1);
+            }
+            bytes = 0;
+        }
+
+        ReadRequest* r = (ReadRequest*)ov;
+        int slotID = r->slotID;
+        outstanding--;
+        slotBytes[slotID] += bytes - r->shadowBytes;
+
+        if (--pending[slotID] == 0) {
+            UINT64 off = slotOffset[slotID];
+            int file = slotFile[slotID];
+            UINT64 size = inputs[file].size;
+            DWORD bytesRead = slotBytes[slotID];
+            if (bytesRead != (size - off < B ? size - off : B)) {
+                printf("Short read in %s at offset %llu: %d bytes\n", inputs[file].name, off, bytesRead);
+                exit(-1);
+            }
+
+            EnterCriticalSection(&cs);
+            totalBytesRead += bytesRead;
+            inputs[file].bytes += bytesRead;
+            LeaveCriticalSection(&cs);
+
+            MyBuf mb;
+            FrameSlot(slotID, bytesRead, slotSeq[slotID], off == 0, off + B > size, off, file, &mb);
+            ProduceRead(&mb);
+        }
+    }
+
+    CloseHandle(port);
+    for (size_t i = 0; i < inputs.size(); i++) {
+        CloseHandle(handles[i]);
+    }
+    delete[] handles;
+    delete[] requests;
+    delete[] pending;
+    delete[] slotBytes;
+    delete[] slotOffset;
+    delete[] slotSeq;
+    delete[] slotFile;
+
+    init_mergeTime = getTime();
+
+    int slot = 0;
+    for (int i = 0; i < nSlots; i++) {
+        pcEmpty->Consume(&slot);
+    }
+    SetEvent(terminateEvent);
+}
+
+DWORD WINAPI ReaderThread(LPVOID p) {
+    ((MainThreadClass*)p)->ReadChunks();
+    return 0;
+}
+
+// Starts nReaders threads that claim chunks in file order but read and complete them in any order.
+void MainThreadClass::DiskReadParallel() {
+    for (int i = 0; i < nSlots; i++) {
+        pcEmpty->Produce(&i);
+    }
+
+    totalBytesRead = 0;
+
+    HANDLE* readers = new HANDLE[nReaders];
+    for (int i = 0; i < nReaders; i++) {
+        if ((readers[i] = CreateThread(NULL, 0, ReaderThread, this, 0, NULL)) == NULL) {
+            printf("(-) Error %d creating thread.", GetLastError());
+            exit(-1);
+        }
+    }
+    for (int i = 0; i < nReaders; i++) {
+        WaitForSingleObject(readers[i], INFINITE);
+        CloseHandle(readers[i]);
+    }
+    delete[] readers;
+
+    init_mergeTime = getTime();
+
+    int slot = 0;
+    for (int i = 0; i < nSlots; i++) {
+        pcEmpty->Consume(&slot);
+    }
+    SetEvent(terminateEvent);
+}
+
+// one parallel reader, with handles of its own so positional reads are not serialized
+void MainThreadClass::ReadChunks() {
+    LowerMemoryPriority();
+    HANDLE* handles = new HANDLE[inputs.size()];
+    for (size_t i = 0; i < inputs.size(); i++) {
+        handles[i] = INVALID_HANDLE_VALUE;
+    }
+
+    while (true) {
+        // a chunk is claimed only with a slot in hand, so the filter never waits on one without
+        int slotID;
+        if (TakeSlot(&slotID) == -1) {
+            break;
+        }
+
+        LONG64 chunk = InterlockedIncrement64(&nextChunk) - 1;
+        if (chunk >= (LONG64)nChunks) {
+            pcEmpty->Produce(&slotID);
+            break;
+        }
+
+        int f = FileOfChunk(chunk);
+        if (handles[f] == INVALID_HANDLE_VALUE) {
+            handles[f] = CreateFile(inputs[f].name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, cacheFlags, NULL);
+            if (handles[f] == INVALID_HANDLE_VALUE) {
+                printf("CreateFile error: %d\n", GetLastError());
+                exit(-1);
+            }
+        }
+
+        UINT64 local = chunk - inputs[f].firstChunk;
+        UINT64 size = inputs[f].size;
+        UINT64 off = local * B;
+        DWORD want = (DWORD)(size - off < B ? size - off : B);
+        char* currBuf = mega_buf + ((UINT64)slotID * slotSize);
+
+        OVERLAPPED ov;
+        memset(&ov, 0, sizeof(OVERLAPPED));
+        ov.Offset = (DWORD)off;
+        ov.OffsetHigh = (DWORD)(off >> 32);
+
+        // under UTF-8 a chunk also takes the continuation bytes that finish its last character
+        DWORD ahead = utf8 ? (DWORD)(size - off - want < 3 ? size - off - want : 3) : 0;
+        DWORD bytesRead = 0;
+        if (want > 0 && (ReadFile(handles[f], currBuf + shadowSize, want + ahead, &bytesRead, &ov) == FALSE || bytesRead != want + ahead)) {
+            printf("ReadFile error: %d\n", GetLastError());
+            exit(-1);
+        }
+        DWORD lead = 0;
+        while (utf8 && local > 0 && lead < 3 && lead < want && ((UCHAR)currBuf[shadowSize + lead] & 0xC0) == 0x80) {
+            lead++;
+        }
+        DWORD extra = 0;
+        while (extra < ahead && ((UCHAR)currBuf[shadowSize + want + extra] & 0xC0) == 0x80) {
+            extra++;
+        }
+
+        EnterCriticalSection(&cs);
+        totalBytesRead += want;
+        inputs[f].bytes += want;
+        LeaveCriticalSection(&cs);
+
+        // offsetting edge keys by the file index keeps words from being stitched across files
+        UINT64 seq = chunk + f;
+        MyBuf mb;
+        FrameStitched(slotID, lead, want + extra - lead, seq, seq + 1, local == 0, local == inputs[f].nChunks - 1, off, f, &mb);
+        ProduceRead(&mb);
+    }
+
+    for (size_t i = 0; i < inputs.size(); i++) {
+        if (handles[i] != INVALID_HANDLE_VALUE) {
+            CloseHandle(handles[i]);
+        }
+    }
+    delete[] handles;
+}
+
+// filters the chunks of each file in order, holding each back until the next can no longer blank it
+void MainThreadClass::FilterChunks() {
+    std::vector<MarkupFilter> filters(inputs.size());
+    std::vector<UINT64> expected(inputs.size(), (UINT64)-1);
+    std::vector<MyBuf> held(inputs.size());
+    std::vector<MyBuf> early;
+
+    MyBuf mb;
+    while (pcRaw->Consume(&mb) != -1) {
+        early.push_back(mb);
+        size_t i = 0;
+        while (i < early.size()) {
+            MyBuf cb = early[i];
+            int f = cb.fileID;
+            if (!cb.first && cb.seq != expected[f]) {
+                i++;
+                continue;
+            }
+            early.erase(early.begin() + i);
+            FilterChunk(&cb, cb.first ? nullptr : &held[f], &filters[f]);
+            expected[f] = cb.nextSeq;
+            if (!cb.first) {
+                ProduceFull(&held[f]);
+            }
+            if (cb.last) {
+                ProduceFull(&cb);
+            }
+            else {
+                held[f] = cb;
+            }
+            // the chunk may have unblocked one that came before it
+            i = 0;
+        }
+    }
+}
+
+char* MainThreadClass::ChunkData(MyBuf* cb) {
+    return cb->stitch ? cb->ptr : mega_buf + ((UINT64)cb->slotID * slotSize) + shadowSize;
+}
+
+void MainThreadClass::FilterChunk(MyBuf* cb, MyBuf* prev, MarkupFilter* filter) {
+    char* data = ChunkData(cb);
+    if (prev == nullptr) {
+        filter->Reset();
+        filter->Run(data, 0, cb->bytes, nullptr, 0);
+        return;
+    }
+    char* prevData = ChunkData(prev);
+    filter->Run(data, 0, cb->bytes, prevData, prev->bytes);
+    if (!cb->stitch) {
+        // only the last chunk of a file is shorter than the shadow, and nothing follows it
+        DWORD shadowCopy = lenLongestWord + lookBehind;
+        memcpy(data - shadowCopy, prevData + prev->bytes - shadowCopy, shadowCopy);
+    }
+}
+
+DWORD WINAPI DecoderThread(LPVOID p) {
+    ((MainThreadClass*)p)->DecodeStreams();
+    return 0;
+}
+
+// feeds the stream ranges of a multistream .bz2, from the index or a header scan, to the decoder threads
+void MainThreadClass::DiskReadBzip2() {
+    for (int i = 0; i < nSlots; i++) {
+        pcEmpty->Produce(&i);
+    }
+
+    totalBytesRead = 0;
+
+    HANDLE* decoders = new HANDLE[nReaders];
+    for (int i = 0; i < nReaders; i++) {
+        if ((decoders[i] = CreateThread(NULL, 0, DecoderThread, this, 0, NULL)) == NULL) {
+            printf("(-) Error %d creating thread.", GetLastError());
+            exit(-1);
+        }
+    }
+
+    // one range index is left out after each file so no edge spans two files
+    StreamRange r;
+    r.index = 0;
+    nStreams = 0;
+    for (int f = 0; f < (int)inputs.size(); f++) {
+        UINT64 firstIndex = r.index;
+        if (indexName != nullptr) {
+            std::vector<UINT64> starts;
+            LoadStreamIndex(starts);
+
+            for (size_t i = 0; i < starts.size(); i++) {
+                r.start = starts[i];
+                r.end = i + 1 < starts.size() ? starts[i + 1] : inputs[f].size;
+                r.fileID = f;
+                r.first = i == 0;
+                r.last = i + 1 == starts.size();
+                pcStreams->Produce(&r);
+                r.index++;
+            }
+        }
+        else {
+            HANDLE hFile = CreateFile(inputs[f].name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+            if (hFile == INVALID_HANDLE_VALUE) {
+                printf("CreateFile error: %d\n", GetLastError());
+                exit(-1);
+            }
+            ScanStreams(hFile, f, &r);
+            CloseHandle(hFile);
+        }
+        nStreams += r.index - firstIndex;
+        r.index++;
+    }
+
+    StreamRange quit;
+    quit.index = (UINT64)-1;
+    for (int i = 0; i < nReaders; i++) {
+        pcStreams->Produce(&quit);
+    }
+    for (int i = 0; i < nReaders; i++) {
+        WaitForSingleObject(decoders[i], INFINITE);
+        CloseHandle(decoders[i]);
+    }
+    delete[] decoders;
+
+    init_mergeTime = getTime();
+
+    int slot = 0;
+    for (int i = 0; i < nSlots; i++) {
+        pcEmpty->Consume(&slot);
+    }
+    SetEvent(terminateEvent);
+}
+
+// finds stream starts by their "BZh" header and block magic and queues each stream once the next one shows up
+void MainThreadClass::ScanStreams(HANDLE hFile, int fileID, StreamRange* r) {
+    const int headerLen = 10;
+    static const unsigned char blockMagic[6] = { 0x31, 0x41, 0x59, 0x26, 0x53, 0x59 };
+
+    unsigned char* buf = (unsigned char*)malloc(SCAN_BLOCK + headerLen);
+    DWORD carry = 0; // header bytes that may straddle the previous block
+    UINT64 bufOff = 0; // file offset of buf[0]
+    UINT64 prevStart = 0;
+    r->fileID = fileID;
+    r->first = true;
+
+    while (true) {
+        DWORD bytesRead = 0;
+        if (ReadFile(hFile, buf + carry, SCAN_BLOCK, &bytesRead, NULL) == FALSE && GetLastError() != ERROR_HANDLE_EOF) {
+            printf("ReadFile error: %d\n", GetLastError());
+            exit(-1);
+        }
+        DWORD n = carry + bytesRead;
+
+        for (DWORD i = 0; i + headerLen <= n; i++) {
+            if (buf[i] != 'B' || buf[i + 1] != 'Z' || buf[i + 2] != 'h' || buf[i + 3] < '1' || buf[i + 3] > '9' ||
+                memcmp(buf + i + 4, blockMagic, sizeof(blockMagic)) != 0) {
+                continue;
+            }
+            UINT64 start = bufOff + i;
+            if (start == 0) {
+                continue;
+            }
+            r->start = prevStart;
+            r->end = start;
+            r->last = false;
+            pcStreams->Produce(r);
+            r->index++;
+            r->first = false;
+            prevStart = start;
+        }
+
+        if (bufOff == 0 && (n < 3 || buf[0] != 'B' || buf[1] != 'Z' || buf[2] != 'h')) {
+            printf("%s is not a bzip2 file\n", inputs[fileID].name);
+            exit(-1);
+        }
+
+        if (bytesRead == 0) {
+            break;
+        }
+        carry = n < headerLen - 1 ? n : headerLen - 1;
+        memmove(buf, buf + n - carry, carry);
+        bufOff += n - carry;
+    }
+
+    r->start = prevStart;
+    r->end = inputs[fileID].size;
+    r->last = true;
+    pcStreams->Produce(r);
+    r->index++;
+
+    free(buf);
+}
+
+// reads the stream offsets of a multistream index, plain or .bz2
+void MainThreadClass::LoadStreamIndex(std::vector<UINT64>& starts) {
+    FILE* f = fopen(indexName, "rb");
+    if (f == nullptr) {
+        printf("Cannot open index %s\n", indexName);
+        exit(-1);
+    }
+
+    size_t len = strlen(indexName);
+    bool compressed = len > 4 && _stricmp(indexName + len - 4, ".bz2") == 0;
+
+    const int blockSize = 1 << 20;
+    char* in = (char*)malloc(blockSize);
+    char* out = (char*)malloc(blockSize);
+    bz_stream strm;
+    memset(&strm, 0, sizeof(bz_stream));
+    if (compressed && BZ2_bzDecompressInit(&strm, 0, 0) != BZ_OK) {
+        printf("BZ2_bzDecompressInit failed\n");
+        exit(-1);
+    }
+
+    UINT64 value = 0;
+    bool inOffset = true; // still reading the digits at the start of a line
+    bool done = false;
+
+    starts.push_back(0);
+    while (!done) {
+        size_t n;
+        if (compressed) {
+            if (strm.avail_in == 0) {
+                strm.avail_in = (unsigned int)fread(in, 1, blockSize, f);
+                strm.next_in = in;
+            }
+            strm.next_out = out;
+            strm.avail_out = blockSize;
+            int ret = BZ2_bzDecompress(&strm);
+            if (ret == BZ_STREAM_END) {
+                // the next stream of the index starts right after this one
+                char* nextIn = strm.next_in;
+                unsigned int availIn = strm.avail_in;
+                BZ2_bzDecompressEnd(&strm);
+                memset(&strm, 0, sizeof(bz_stream));
+                BZ2_bzDecompressInit(&strm, 0, 0);
+                strm.next_in = nextIn;
+                strm.avail_in = availIn;
+                if (availIn == 0 && feof(f)) {
+                    done = true;
+                }
+            }
+            else if (ret != BZ_OK) {
+                printf("bzip2 error %d in index %s\n", ret, indexName);
+                exit(-1);
+            }
+            else if (strm.avail_in == 0 && feof(f) && strm.avail_out == blockSize) {
+                done = true;
+            }
+            n = blockSize - strm.avail_out;
+        }
+        else {
+            n = fread(out, 1, blockSize, f);
+            done = n == 0;
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            char c = out[i];
+            if (c == '\n') {
+                inOffset = true;
+                value = 0;
+            }
+            else if (inOffset && c >= '0' && c <= '9') {
+                value = value * 10 + (c - '0');
+            }
+            else if (inOffset) {
+                // consecutive pages share a stream, so only new offsets start a range
+                if (value > starts.back()) {
+                    starts.push_back(value);
+                }
+                inOffset = false;
+            }
+        }
+    }
+
+    if (compressed) {
+        BZ2_bzDecompressEnd(&strm);
+    }
+    free(in);
+    free(out);
+    fclose(f);
+
+    if (starts.back() >= inputs[0].size) {
+        printf("Index %s does not match %s\n", indexName, inputs[0].name);
+        exit(-1);
+    }
+}
+
+// one bzip2 decoder; each filled slot is held back until the next, so a range's last chunk links to the next range
+void MainThreadClass::DecodeStreams() {
+    LowerMemoryPriority();
+    HANDLE* handles = new HANDLE[inputs.size()];
+    for (size_t i = 0; i < inputs.size(); i++) {
+        handles[i] = INVALID_HANDLE_VALUE;
+    }
+
+    char* in = nullptr;
+    UINT64 inCapacity = 0;
+    StreamRange r;
+    // ranges start on a page boundary, so each is filtered from a clean state
+    MarkupFilter filter;
+
+    while (pcStreams->Consume(&r) != -1 && r.index != (UINT64)-1) {
+        int f = r.fileID;
+        if (handles[f] == INVALID_HANDLE_VALUE) {
+            handles[f] = CreateFile(inputs[f].name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, cacheFlags, NULL);
+            if (handles[f] == INVALID_HANDLE_VALUE) {
+                printf("CreateFile error: %d\n", GetLastError());
+                exit(-1);
+            }
+        }
+
+        UINT64 len = r.end - r.start;
+        if (len > inCapacity) {
+            free(in);
+            inCapacity = len;
+            in = (char*)malloc(inCapacity);
+        }
+
+        OVERLAPPED ov;
+        memset(&ov, 0, sizeof(OVERLAPPED));
+        ov.Offset = (DWORD)r.start;
+        ov.OffsetHigh = (DWORD)(r.start >> 32);
+        DWORD bytesRead = 0;
+        if (ReadFile(handles[f], in, (DWORD)len, &bytesRead, &ov) == FALSE || bytesRead != len) {
+            printf("ReadFile error: %d\n", GetLastError());
+            exit(-1);
+        }
+
+        bz_stream strm;
+        memset(&strm, 0, sizeof(bz_stream));
+        BZ2_bzDecompressInit(&strm, 0, 0);
+        strm.next_in = in;
+        strm.avail_in = (unsigned int)len;
+
+        UINT64 seq = r.index << 32;
+        UINT64 produced = 0;
+        int slotID;
+        if (TakeSlot(&slotID) == -1) {
+            BZ2_bzDecompressEnd(&strm);
+            break;
+        }
+        DWORD filled = 0;
+        DWORD filtered = 0;
+        bool pending = false;
+        bool quit = false;
+        MyBuf held;
+        filter.Reset();
+
+        while (true) {
+            strm.next_out = mega_buf + ((UINT64)slotID * slotSize) + shadowSize + filled;
+            strm.avail_out = B - filled;
+            int ret = BZ2_bzDecompress(&strm);
+            filled = B - strm.avail_out;
+            if (filterMode != FILTER_NONE) {
+                filter.Run(mega_buf + ((UINT64)slotID * slotSize) + shadowSize, filtered, filled, pending ? held.ptr : nullptr, pending ? held.bytes : 0);
+                filtered = filled;
+            }
+
+            if (ret == BZ_STREAM_END) {
+                BZ2_bzDecompressEnd(&strm);
+                if (strm.avail_in == 0) {
+                    break;
+                }
+                // several streams can share a range when headers were missed or not indexed
+                char* nextIn = strm.next_in;
+                unsigned int availIn = strm.avail_in;
+                memset(&strm, 0, sizeof(bz_stream));
+                BZ2_bzDecompressInit(&strm, 0, 0);
+                strm.next_in = nextIn;
+                strm.avail_in = availIn;
+            }
+            else if (ret != BZ_OK || (strm.avail_in == 0 && filled < B)) {
+                printf("bzip2 error %d in %s at offset %llu\n", ret, inputs[f].name, r.start);
+                exit(-1);
+            }
+
+            if (filled == B) {
+                if (pending) {
+                    ProduceFull(&held);
+                }
+                // under UTF-8 a character cut by the end of the slot moves on to the next one
+                char* data = mega_buf + ((UINT64)slotID * slotSize) + shadowSize;
+                DWORD carry = utf8 ? SplitCharBytes(data, filled) : 0;
+                char carried[3];
+                memcpy(carried, data + filled - carry, carry);
+                FrameStitched(slotID, 0, filled - carry, seq, seq + 1, r.first && seq == r.index << 32, false, r.start, f, &held);
+                pending = true;
+                produced += filled - carry;
+                seq++;
+                if (TakeSlot(&slotID) == -1) {
+                    quit = true;
+                    break;
+                }
+                memcpy(mega_buf + ((UINT64)slotID * slotSize) + shadowSize, carried, carry);
+                filled = carry;
+                filtered = carry;
+            }
+        }
+        if (quit) {
+            // the stream is still open, and the slots it filled are gone with the run
+            BZ2_bzDecompressEnd(&strm);
+            break;
+        }
+
+        if (filled > 0 || !pending) {
+            if (pending) {
+                ProduceFull(&held);
+            }
+            // a range that decompresses to nothing still links its neighbours
+            FrameStitched(slotID, 0, filled, seq, seq + 1, r.first && seq == r.index << 32, false, r.start, f, &held);
+            produced += filled;
+        }
+        else {
+            pcEmpty->Produce(&slotID);
+        }
+        held.nextSeq = (r.index + 1) << 32;
+        held.last = r.last;
+        ProduceFull(&held);
+
+        EnterCriticalSection(&cs);
+        totalBytesRead += len;
+        decompressedBytes += produced;
+        inputs[f].bytes += produced;
+        LeaveCriticalSection(&cs);
+    }
+
+    free(in);
+    for (size_t i = 0; i < inputs.size(); i++) {
+        if (handles[i] != INVALID_HANDLE_VALUE) {
+            CloseHandle(handles[i]);
+        }
+    }
+    delete[] handles;
+}
+
+// maps every input, falling back to sync when a file's last word reaches back past its last chunk
+void MainThreadClass::MapInput() {
+    bool fits = true;
+    for (size_t f = 0; f < inputs.size() && fits; f++) {
+        UINT64 size = inputs[f].size;
+        if (size == 0) {
+            continue;
+        }
+
+        HANDLE hFile = CreateFile(inputs[f].name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, cacheFlags, NULL);
+        if (hFile == INVALID_HANDLE_VALUE) {
+            printf("CreateFile error: %d\n", GetLastError());
+            exit(-1);
+        }
+
+        HANDLE hMap = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (hMap == NULL) {
+            printf("CreateFileMapping error: %d\n", GetLastError());
+            exit(-1);
+        }
+        char* base = (char*)MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
+        if (base == NULL) {
+            printf("MapViewOfFile error: %d\n", GetLastError());
+            exit(-1);
+        }
+        // the view keeps the mapping and the file alive
+        CloseHandle(hMap);
+        CloseHandle(hFile);
+        inputs[f].mapBase = base;
+
+        UINT64 lastOff = size / B * B;
+        UINT64 tail = size;
+        // under UTF-8 any high byte may be part of a letter
+        while (tail > 0 && (isalphaLUT[(unsigned char)base[tail - 1]] || (utf8 && (UCHAR)base[tail - 1] >= 0x80))) {
+            tail--;
+        }
+        fits = tail >= lastOff;
+    }
+
+    if (!fits) {
+        for (size_t f = 0; f < inputs.size(); f++) {
+            if (inputs[f].mapBase != nullptr) {
+                UnmapViewOfFile(inputs[f].mapBase);
+                inputs[f].mapBase = nullptr;
+            }
+        }
+        readerMode = READER_SYNC;
+        return;
+    }
+
+    for (int i = 0; i < nSlots; i++) {
+        pcEmpty->Produce(&i);
+    }
+}
+
+// hands the next chunk to a consumer; mapped ranges point into the view, file edges are staged in a slot
+int MainThreadClass::GetChunk(MyBuf* cb, int node) {
+    if (readerMode != READER_MAPPED) {
+        int ret;
+        if (!autoTune || (ret = TakeFull(cb, node, 0)) != 1) {
+            return autoTune ? ret : TakeFull(cb, node, INFINITE);
+        }
+        // only a wait that really blocks counts as idle time
+        LONGLONG t = getTime();
+        ret = TakeFull(cb, node, INFINITE);
+        InterlockedExchangeAdd64(&idleTicks, getTime() - t);
+        return ret;
+    }
+
+    LONG64 chunk = InterlockedIncrement64(&nextChunk) - 1;
+    if (chunk >= (LONG64)nChunks) {
+        return -1;
+    }
+
+    int f = FileOfChunk(chunk);
+    char* base = inputs[f].mapBase;
+    UINT64 size = inputs[f].size;
+    UINT64 local = chunk - inputs[f].firstChunk;
+    UINT64 off = local * B;
+    DWORD bytes = (DWORD)(size - off < B ? size - off : B);
+    bool first = local == 0;
+    bool last = local == inputs[f].nChunks - 1;
+
+    if (first || last) {
+        int slotID;
+        if (pcEmpty->Consume(&slotID) == -1) {
+            return -1;
+        }
+        char* currBuf = mega_buf + ((UINT64)slotID * slotSize);
+        if (bytes > 0) {
+            memcpy(currBuf + shadowSize, base + off, bytes);
+            if (cachePolicy == CACHE_STREAM) {
+                VirtualUnlock(base + off, bytes);
+            }
+        }
+        if (!first) {
+            memcpy(currBuf + shadowSize - lenLongestWord - lookBehind, base + off - lenLongestWord - lookBehind, lenLongestWord + lookBehind);
+        }
+        FrameSlot(slotID, bytes, chunk, first, last, off, f, cb);
+    }
+    else {
+        cb->ptr = base + off - lenLongestWord;
+        cb->size = bytes + 1;
+        cb->first = false;
+        cb->last = false;
+        cb->stitch = false;
+        cb->slotID = -1;
+        cb->offset = off;
+        cb->fileID = f;
+    }
+
+    if (cachePolicy == CACHE_STREAM && chunk + STREAM_AHEAD < (LONG64)nChunks) {
+        // each claim moves the read-ahead window on by one chunk
+        UINT64 ahead = chunk + STREAM_AHEAD;
+        int af = FileOfChunk(ahead);
+        UINT64 aheadOff = (ahead - inputs[af].firstChunk) * B;
+        if (aheadOff < inputs[af].size) {
+            WIN32_MEMORY_RANGE_ENTRY range;
+            range.VirtualAddress = inputs[af].mapBase + aheadOff;
+            range.NumberOfBytes = (SIZE_T)(inputs[af].size - aheadOff < B ? inputs[af].size - aheadOff : B);
+            PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+        }
+    }
+
+    EnterCriticalSection(&cs);
+    totalBytesRead += bytes;
+    inputs[f].bytes += bytes;
+    LeaveCriticalSection(&cs);
+
+    return 0;
+}
+
+// a filled slot for a worker on node, from another node rather than wait
+int MainThreadClass::TakeFull(MyBuf* cb, int node, DWORD ms) {
+    if (nNodes == 1) {
+        return ms == 0 ? pcFull->TryConsume(cb) : pcFull->Consume(cb);
+    }
+    return PC::ConsumeFirst(pcNear, nNodes, node, cb, ms);
+}
+
+void MainThreadClass::ProduceFull(MyBuf* mb) {
+    pcNear[mb->slotID >= 0 ? mb->slotID % nNodes : 0]->Produce(mb);
+}
+
+// where the readers put filled slots: the filter stage, or the workers
+void MainThreadClass::ProduceRead(MyBuf* mb) {
+    if (pcRaw != nullptr) {
+        pcRaw->Produce(mb);
+    }
+    else {
+        ProduceFull(mb);
+    }
+}
+
+// pcEmpty->Consume for the readers; when tuning, waits that block are timed
+int MainThreadClass::TakeSlot(int* slotID) {
+    int ret;
+    if (!autoTune || (ret = pcEmpty->TryConsume(slotID)) != 1) {
+        return autoTune ? ret : pcEmpty->Consume(slotID);
+    }
+    LONGLONG t = getTime();
+    ret = pcEmpty->Consume(slotID);
+    InterlockedExchangeAdd64(&stallTicks, getTime() - t);
+    return ret;
+}
+
+// puts the pages the calling thread reads at the low-priority end of the standby list
+void MainThreadClass::LowerMemoryPriority() {
+    if (cachePolicy != CACHE_STREAM) {
+        return;
+    }
+    MEMORY_PRIORITY_INFORMATION info;
+    info.MemoryPriority = MEMORY_PRIORITY_VERY_LOW;
+    SetThreadInformation(GetCurrentThread(), ThreadMemoryPriority, &info, sizeof(info));
+}
+
+void MainThreadClass::ReleaseChunk(MyBuf* cb) {
+    if (cb->slotID >= 0) {
+        pcEmpty->Produce(&cb->slotID);
+    }
+    else if (cachePolicy == CACHE_STREAM) {
+        // drops the finished range of the view from the working set
+        VirtualUnlock(cb->ptr + lenLongestWord, cb->size - 1);
+    }
+    if (readerMode == READER_MAPPED && InterlockedIncrement64(&chunksDone) == (LONG64)nChunks) {
+        SetEvent(rangesDone);
+    }
+}
+
+void MainThreadClass::CountWord(TableShards* ht, UINT64 hashKey, char* word, DWORD wordLen) {
+    if (ht->sketch != nullptr) {
+        ht->sketch->Add(hashKey);
+        return;
+    }
+    if (ht->heavy != nullptr) {
+        PackedKey key = { { hashKey, 0, 0 } };
+        if (packedKeys) {
+            PackWord(word, wordLen, &key);
+            hashKey = PackedHash(key);
+        }
+        ht->heavy->Add(key.lane, hashKey, word, wordLen);
+        return;
+    }
+    bool found;
+    DWORD* counter;
+    if (packedKeys) {
+        PackedKey key;
+        PackWord(word, wordLen, &key);
+        UINT64 h = PackedHash(key);
+        counter = ht->ShardOf(h)->FindInsertPacked(key, h, found);
+    }
+    else {
+        counter = ht->ShardOf(hashKey)->FindInsertKey(hashKey, word, wordLen, found);
+    }
+    if (tableEngine == TABLE_SHARED) {
+        InterlockedIncrement((volatile LONG*)counter);
+    }
+    else {
+        (*counter)++;
+    }
+}
+
+// queues a word for FlushBatch and prefetches its first line; copy marks a word in a reused buffer
+void MainThreadClass::BatchWord(InsertBatch* b, TableShards* ht, UINT64 hashKey, char* word, DWORD wordLen, bool copy) {
+    int i = b->n++;
+    bool isLong = false;
+    if (packedKeys) {
+        PackWord(word, wordLen, &b->key[i]);
+        hashKey = PackedHash(b->key[i]);
+        isLong = (b->key[i].lane[0] & PACKED_LONG) != 0;
+    }
+    else if (copy) {
+        memcpy(b->copies[i], word, wordLen);
+        word = b->copies[i];
+    }
+    b->hash[i] = hashKey;
+    b->word[i] = word;
+    b->len[i] = wordLen;
+    if (ht->heavy != nullptr) {
+        if (!packedKeys) {
+            PackedKey key = { { hashKey, 0, 0 } };
+            b->key[i] = key;
+        }
+        b->heavy = ht->heavy;
+        b->heavy->Prefetch(hashKey);
+    }
+    else {
+        b->table[i] = ht->ShardOf(hashKey);
+        b->table[i]->Prefetch(hashKey, isLong);
+    }
+    if (b->n == insertBatch) {
+        FlushBatch(b);
+    }
+}
+
+// counts the queued words after prefetching their entries; must run before their chunk is released
+void MainThreadClass::FlushBatch(InsertBatch* b) {
+    if (b->heavy != nullptr) {
+        for (int i = 0; i < b->n; i++) {
+            b->heavy->PrefetchCounter(b->hash[i]);
+        }
+        for (int i = 0; i < b->n; i++) {
+            b->heavy->Add(b->key[i].lane, b->hash[i], b->word[i], b->len[i]);
+        }
+        b->n = 0;
+        return;
+    }
+    for (int i = 0; i < b->n; i++) {
+        b->table[i]->PrefetchEntry(b->hash[i]);
+    }
+    for (int i = 0; i < b->n; i++) {
+        bool found;
+        DWORD* counter = packedKeys ? b->table[i]->FindInsertPacked(b->key[i], b->hash[i], found)
+            : b->table[i]->FindInsertKey(b->hash[i], b->word[i], b->len[i], found);
+        if (tableEngine == TABLE_SHARED) {
+            InterlockedIncrement((volatile LONG*)counter);
+        }
+        else {
+            (*counter)++;
+        }
+    }
+    b->n = 0;
+}
+
+// hands the partial words at both ends of a stitched chunk to their edges and returns where the scan starts
+int MainThreadClass::SplitEdges(MyBuf* cb, TableShards* ht, DWORD* t_words, DWORD* i_words) {
+    char* buf = cb->ptr;
+    int size = cb->size;
+
+    int head = 0;
+    int tail = size;
+    DWORD headWide = 0;
+    DWORD tailWide = 0;
+    char headDelim;
+    char tailDelim;
+    if (!utf8) {
+        while (head < size && isalphaLUT[(unsigned char)buf[head]]) {
+            head++;
+        }
+        while (tail > head && isalphaLUT[(unsigned char)buf[tail - 1]]) {
+            tail--;
+        }
+        headDelim = buf[head];
+        tailDelim = buf[tail - 1];
+    }
+    else {
+        // the readers cut stitched chunks between characters, so both runs decode cleanly
+        int cls;
+        WORD cp;
+        while (head < size) {
+            int n = DecodeChar(buf + head, &cls, &cp);
+            if (cls != CHAR_LETTER) {
+                headDelim = cp < 0x80 ? (char)cp : cls == CHAR_DELIM ? ' ' : '\x01';
+                break;
+            }
+            head += n;
+            headWide += n - 1;
+        }
+        while (tail > head) {
+            int n = DecodeCharBefore(buf + tail, &cls);
+            if (cls != CHAR_LETTER) {
+                tailDelim = (UCHAR)buf[tail - 1] < 0x80 ? buf[tail - 1] : cls == CHAR_DELIM ? ' ' : '\x01';
+                break;
+            }
+            tail -= n;
+            tailWide += n - 1;
+        }
+    }
+
+    WordFragment frag;
+    frag.allAlpha = head == size;
+    frag.eof = false;
+
+    frag.len = head;
+    frag.wide = headWide;
+    memcpy(frag.letters, buf, head < lenLongestWord ? head : lenLongestWord);
+    frag.delim = frag.allAlpha ? '\0' : headDelim;
+    frag.nextKey = cb->nextSeq;
+    if (cb->first) {
+        // the start of the file is an edge with nothing in front of it
+        WordFragment start;
+        start.len = 0;
+        start.wide = 0;
+        start.delim = '\0';
+        start.allAlpha = false;
+        start.eof = false;
+        start.nextKey = 0;
+        StitchEdge(cb->seq, &start, true, ht, t_words, i_words);
+    }
+    StitchEdge(cb->seq, &frag, false, ht, t_words, i_words);
+
+    // an all-letter chunk carries its word over to the edge past it
+    if (!frag.allAlpha) {
+        frag.len = size - tail;
+        frag.wide = tailWide;
+        memcpy(frag.letters, buf + tail, frag.len < lenLongestWord ? frag.len : lenLongestWord);
+        frag.delim = tailDelim;
+        StitchEdge(cb->nextSeq, &frag, true, ht, t_words, i_words);
+    }
+    if (cb->last) {
+        WordFragment end;
+        end.len = 0;
+        end.wide = 0;
+        end.delim = '\0';
+        end.allAlpha = false;
+        end.eof = true;
+        end.nextKey = 0;
+        StitchEdge(cb->nextSeq, &end, false, ht, t_words, i_words);
+    }
+
+    cb->size = frag.allAlpha ? 0 : tail;
+    return head;
+}
+
+// records one side of an edge; the second side to arrive joins the fragments and counts the word
+void MainThreadClass::StitchEdge(UINT64 key, WordFragment* frag, bool left, TableShards* ht, DWORD* t_words, DWORD* i_words) {
+    ChunkEdge e;
+
+    EnterCriticalSection(&edgeCs);
+    ChunkEdge& slot = edges[key];
+    if (left) {
+        slot.left = *frag;
+    }
+    else {
+        slot.right = *frag;
+    }
+    if (++slot.arrivals < 2) {
+        LeaveCriticalSection(&edgeCs);
+        return;
+    }
+    e = slot;
+    edges.erase(key);
+    LeaveCriticalSection(&edgeCs);
+
+    DWORD wordLen = e.left.len + e.right.len;
+    if (e.right.allAlpha) {
+        WordFragment joined = e.left;
+        if (joined.len < lenLongestWord) {
+            DWORD n = lenLongestWord - joined.len;
+            memcpy(joined.letters + joined.len, e.right.letters, e.right.len < n ? e.right.len : n);
+        }
+        joined.len = wordLen;
+        joined.wide += e.right.wide;
+        StitchEdge(e.right.nextKey, &joined, true, ht, t_words, i_words);
+        return;
+    }
+    if (wordLen == 0) {
+        return;
+    }
+
+    (*t_words)++;
+    // a word that reaches the end of the file is invalid, same as when the scan hits the final '\0'
+    DWORD chars = wordLen - e.left.wide - e.right.wide;
+    if (e.right.eof || chars < 3 || chars > 31 ||
+        !isdelimiterLUT[(unsigned char)e.left.delim] || !isdelimiterLUT[(unsigned char)e.right.delim]) {
+        (*i_words)++;
+        return;
+    }
+
+    // HashWord and PackWord may read up to 7 bytes in front of the word
+    char wordBuf[8 + LONGEST_WORD_UTF8];
+    char* word = wordBuf + 8;
+    memcpy(word, e.left.letters, e.left.len);
+    memcpy(word + e.left.len, e.right.letters, e.right.len);
+    if (chars != wordLen) {
+        wordLen = FoldWord(word, wordLen, word);
+    }
+
+    CountWord(ht, packedKeys ? 0 : HashWord(word, wordLen), word, wordLen);
+}
+
+bool strcompare(char* s1, char* s2) {
+    while (*s1 != '\0') {
+        if (*s1 != *s2) {
+            return false;
+        }
+        s1++;
+        s2++;
+    }
+    return true;
+}
+
+unsigned int hashStr(char* str) {
+    unsigned char* s = (unsigned char*)str;
+    return ((unsigned int)(s[0]) << 16) + ((unsigned int)(s[1]) << 8) + (unsigned int)s[2];
+}
+
+// splits the byte classes into nibble tables; false when they do not fit and the scalar tokenizer is used
+bool MainThreadClass::BuildNibbleTables() {
+    memset(loNibbleLUT, 0, sizeof(loNibbleLUT));
+    memset(hiNibbleLUT, 0, sizeof(hiNibbleLUT));
+    alphaBits = 0;
+    delimBits = 0;
+
+    int nextBit = 0;
+    for (int cls = 0; cls < 2; cls++) {
+        char* lut = cls == 0 ? isalphaLUT : isdelimiterLUT;
+        UCHAR* classBits = cls == 0 ? &alphaBits : &delimBits;
+        WORD seen[8];
+        UCHAR seenBit[8];
+        int nSeen = 0;
+
+        for (int hi = 0; hi < 16; hi++) {
+            WORD set = 0;
+            for (int lo = 0; lo < 16; lo++) {
+                if (lut[hi << 4 | lo]) {
+                    set |= 1 << lo;
+                }
+            }
+            if (set == 0) {
+                continue;
+            }
+
+            int j = 0;
+            while (j < nSeen && seen[j] != set) {
+                j++;
+            }
+            if (j == nSeen) {
+                if (nextBit == 8) {
+                    return false;
+                }
+                seen[nSeen] = set;
+                seenBit[nSeen++] = 1 << nextBit++;
+                for (int lo = 0; lo < 16; lo++) {
+                    if (set & (1 << lo)) {
+                        loNibbleLUT[lo] |= seenBit[j];
+                    }
+                }
+            }
+            hiNibbleLUT[hi] |= seenBit[j];
+            *classBits |= seenBit[j];
+        }
+    }
+
+    for (int c = 0; c < 256; c++) {
+        UCHAR bits = loNibbleLUT[c & 15] & hiNibbleLUT[c >> 4];
+        if (((bits & alphaBits) != 0) != (isalphaLUT[c] != 0) || ((bits & delimBits) != 0) != (isdelimiterLUT[c] != 0)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// classifies the aligned block holding p unless the cursor has it; aligned loads never cross a page
+void MainThreadClass::Classify(TokenCursor* tc, const char* p) {
+    const char* base = (const char*)((ULONG_PTR)p & ~(ULONG_PTR)(simdWidth - 1));
+    if (base != tc->base) {
+        classify(base, loNibbleLUT, hiNibbleLUT, alphaBits, delimBits, &tc->alpha, &tc->delim, &tc->high);
+        tc->base = base;
+    }
+}
+
+bool MainThreadClass::IsDelimiter(TokenCursor* tc, const char* p) {
+    if (simdLevel != SIMD_SCALAR && p >= tc->base && p < tc->base + simdWidth) {
+        return (tc->delim >> (p - tc->base)) & 1;
+    }
+    return isdelimiterLUT[(unsigned char)*p] == 1;
+}
+
+int MainThreadClass::FindNextWordStart(MyBuf cb, int off, DWORD* wordStart, TokenCursor* tc) {
+    if (utf8) {
+        return FindNextWordStartUtf8(cb, off, wordStart, tc);
+    }
+    char* buf = cb.ptr;
+    DWORD buf_size = cb.size;
+
+    if (simdLevel != SIMD_SCALAR) {
+        const char* p = buf + off;
+        while (p < buf + buf_size) {
+            Classify(tc, p);
+            UINT64 letters = tc->alpha >> (p - tc->base);
+            unsigned long bit;
+            if (_BitScanForward64(&bit, letters)) {
+                DWORD start = (DWORD)(p - buf) + bit;
+                if (start >= buf_size) {
+                    return EOB;
+                }
+                *wordStart = start;
+                return 0;
+            }
+            p = tc->base + simdWidth;
+        }
+        return EOB;
+    }
+
+    while (off < buf_size) {
+        if (isalphaLUT[(unsigned char)buf[off]] == 1) {
+            *wordStart = off;
+            return 0;
+        }
+        off++;
+    }
+
+    return EOB;
+}
+
+int MainThreadClass::FindThisWordEnd(MyBuf cb, DWORD wordStart, DWORD* wordEnd, UINT64* hashKey, TokenCursor* tc) {
+    if (utf8) {
+        return FindThisWordEndUtf8(cb, wordStart, wordEnd, hashKey, tc);
+    }
+    char* buf = cb.ptr;
+    DWORD buf_size = cb.size;
+    DWORD curr = wordStart;
+    int index = 0;
+
+    if (simdLevel != SIMD_SCALAR) {
+        // the '\0' after the data is not a letter either, so the scan always stops
+        const char* p = buf + wordStart;
+        unsigned long bit;
+        while (true) {
+            Classify(tc, p);
+            UINT64 others = ~tc->alpha >> (p - tc->base);
+            if (simdWidth < 64) {
+                others &= (1ULL << (simdWidth - (p - tc->base))) - 1;
+            }
+            if (_BitScanForward64(&bit, others)) {
+                break;
+            }
+            p = tc->base + simdWidth;
+        }
+        curr = (DWORD)(p - buf) + bit;
+        if (buf[curr] == '\0') {
+            return EOB;
+        }
+        // words of ineligible length are never counted, so they are not hashed
+        if (!packedKeys && curr - wordStart <= 31) {
+            if (hashMode == HASH_MIX) {
+                if (curr - wordStart >= 3) {
+                    *hashKey = HashWord(buf + wordStart, curr - wordStart);
+                }
+            }
+            else {
+                for (DWORD i = wordStart; i < curr; i++) {
+                    *hashKey = (*hashKey + sboxLUT[(UCHAR)buf[i]]) * 3;
+                }
+            }
+        }
+        *wordEnd = curr;
+        return 0;
+    }
+
+    if (hashMode == HASH_MIX || packedKeys) {
+        while (isalphaLUT[(unsigned char)buf[curr]]) {
+            curr++;
+        }
+        if (buf[curr] == '\0') {
+            return EOB;
+        }
+        if (!packedKeys && curr - wordStart >= 3 && curr - wordStart <= 31) {
+            *hashKey = HashWord(buf + wordStart, curr - wordStart);
         }
+        *wordEnd = curr;
+        return 0;
+    }
+  
+    while (buf[curr] != '\0') {
+        if (!isalphaLUT[(unsigned char)buf[curr]]) {
+            *wordEnd = curr;
+            return 0;
+        }
+        *hashKey = (*hashKey + sboxLUT[(UCHAR)buf[curr]]) * 3;
+        curr++;
+    }
 
-        nB = nBin;
-        main_hT = new HashTable(nB);
-    };
+    return EOB;
+}
 
-    void ProcessData();
-    void DiskRead();
-    void TrackStats();
+// HASH_MIX: 8-byte lanes multiplied in independent pairs, the last lane ending at the word
+UINT64 MainThreadClass::HashWord(const char* word, DWORD len) {
+    if (hashMode == HASH_SBOX) {
+        UINT64 hashKey = 0;
+        for (DWORD i = 0; i < len; i++) {
+            hashKey = (hashKey + sboxLUT[(UCHAR)word[i]]) * 3;
+        }
+        return hashKey;
+    }
 
-    int FindNextWordStart(MyBuf cb, int off, DWORD* wordStart);
-    int FindThisWordEnd(MyBuf cb, DWORD wordStart, DWORD* wordEnd, UINT64* hashKey);
-    bool WordIsEligible(MyBuf cb, DWORD wordStart, DWORD wordEnd);
-};
+    UINT64 lane[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+    DWORD full = len >> 3;
+    DWORD rest = len & 7;
+    for (DWORD i = 0; i < full; i++) {
+        lane[i] = CASE_FOLD(*(UINT64*)(word + 8 * i));
+    }
+    if (rest != 0) {
+        lane[full] = CASE_FOLD(*(UINT64*)(word + len - 8)) >> (64 - 8 * rest);
+    }
 
-void MainThreadClass::DiskRead() {
-    char* prevShadowBuffer = (char*)malloc(lenLongestWord);
+    UINT64 hi, lo;
+    UINT64 h = 0;
+    for (DWORD i = 0; i < (len + 15) >> 4; i++) {
+        lo = _umul128(lane[2 * i] ^ mixKeys[2 * i], lane[2 * i + 1] ^ mixKeys[2 * i + 1], &hi);
+        h ^= lo ^ hi;
+    }
+    lo = _umul128(h ^ mixKeys[8], len ^ mixKeys[9], &hi);
+    return lo ^ hi;
+}
 
-    for (int i = 0; i < nSlots; i++) {
-        pcEmpty->Produce(&i);
+bool MainThreadClass::WordIsEligible(MyBuf cb, DWORD wordStart, DWORD wordEnd, TokenCursor* tc) {
+    if (utf8) {
+        return WordIsEligibleUtf8(cb, wordStart, wordEnd, tc);
     }
+    char* buf = cb.ptr;
 
-    HANDLE hFile = CreateFile(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-    if (hFile == INVALID_HANDLE_VALUE) {
-        printf("CreateFile error: %d\n", GetLastError());
-        exit(-1);
+    int len = wordEnd - wordStart;
+    if (len < 3 || len > 31) {
+        return false;
     }
 
-    DWORD high, low = GetFileSize(hFile, &high);
-    if (low == INVALID_FILE_SIZE) {
-        printf("GetFileSize error: %d\n", GetLastError());
-        exit(-1);
+    // the cursor still holds the block where the word ended
+    if (!IsDelimiter(tc, buf + (int)wordStart - 1) || !IsDelimiter(tc, buf + wordEnd)) {
+        return false;
     }
-    fileSize = ((UINT64)high << 32) + low;
 
-    totalBytesRead = 0;
-    bool reachedEof = false;
-    bool first = true;
+    return true;
+}
 
-    int slotID = 0;
-    while (!reachedEof) {
-        if (pcEmpty->Consume(&slotID) == -1) {
-            return;
-        }
+// classes and lower case of the two-byte letters, plus the wide punctuation
+void BuildWideTables(UCHAR* wideClassLUT, WORD* wideLowerLUT) {
+    for (int cp = 0; cp < 0x800; cp++) {
+        wideClassLUT[cp] = CHAR_OTHER;
+        wideLowerLUT[cp] = cp;
+    }
 
-        DWORD bytesRead = 0;
-        char* currBuf = mega_buf + (slotID * slotSize);
-        if (ReadFile(hFile, currBuf+shadowSize, B, &bytesRead, NULL) == FALSE) {
-            if (GetLastError() != ERROR_HANDLE_EOF) {
-                printf("ReadFile error: %d\n", GetLastError());
-                exit(-1);
-            }
-            reachedEof = true;
+    // Latin-1 Supplement: upper case is 0x20 below lower case
+    for (int cp = 0xC0; cp <= 0xFF; cp++) {
+        if (cp != 0xD7 && cp != 0xF7) {
+            wideClassLUT[cp] = CHAR_LETTER;
         }
-        else if (bytesRead < B) {
-            reachedEof = true;
+        if (cp <= 0xDE && cp != 0xD7) {
+            wideLowerLUT[cp] = cp + 0x20;
         }
+    }
 
-        EnterCriticalSection(&cs);
-        totalBytesRead += bytesRead;
-        LeaveCriticalSection(&cs);
-
-        //printf("bytes read: %d\n", bytesRead);
-        memcpy(currBuf + shadowSize - lenLongestWord, prevShadowBuffer, lenLongestWord);
-        memcpy(prevShadowBuffer, currBuf + shadowSize + B - lenLongestWord, lenLongestWord);
-
-        MyBuf mb;
-        if (first && !reachedEof) {
-            mb.ptr = currBuf + shadowSize;
-            mb.size = bytesRead - lenLongestWord + 1;
-            mb.first = true;
-
-            mb.ptr[-1] = '\0';
-
-            first = false;
+    // Latin Extended-A: upper and lower case alternate, with a shift of the pairs at 0x139 and 0x179
+    for (int cp = 0x100; cp <= 0x17F; cp++) {
+        wideClassLUT[cp] = CHAR_LETTER;
+        bool upper = (cp <= 0x137 || (cp >= 0x14A && cp <= 0x177)) ? (cp & 1) == 0 : (cp & 1) == 1;
+        if (upper && cp != 0x138 && cp != 0x149 && cp != 0x17F) {
+            wideLowerLUT[cp] = cp + 1;
         }
-        else if (!reachedEof) {
-            mb.ptr = currBuf + shadowSize - lenLongestWord;
-            mb.size = bytesRead + 1;
-            mb.first = false;
+    }
+    wideLowerLUT[0x130] = 'i'; // dotted capital I
+    wideLowerLUT[0x178] = 0xFF; // Y with diaeresis
+
+    // Greek
+    int greek[][2] = { { 0x370, 0x373 }, { 0x376, 0x377 }, { 0x37B, 0x37D }, { 0x37F, 0x37F }, { 0x386, 0x386 },
+        { 0x388, 0x38A }, { 0x38C, 0x38C }, { 0x38E, 0x3A1 }, { 0x3A3, 0x3F5 }, { 0x3F7, 0x3FF } };
+    for (int r = 0; r < 10; r++) {
+        for (int cp = greek[r][0]; cp <= greek[r][1]; cp++) {
+            wideClassLUT[cp] = CHAR_LETTER;
         }
-        else if (first && reachedEof) {
-            mb.ptr = currBuf + shadowSize;
-            mb.size = bytesRead + 1;
-            mb.first = true;
-
-            mb.ptr[-1] = '\0';
-
-            first = false;
+    }
+    for (int cp = 0x391; cp <= 0x3AB; cp++) {
+        if (cp != 0x3A2) {
+            wideLowerLUT[cp] = cp + 0x20;
         }
-        else {
-            mb.ptr = currBuf + shadowSize - lenLongestWord;
-            mb.size = bytesRead + lenLongestWord;
-            mb.first = false;
+    }
+    wideLowerLUT[0x386] = 0x3AC;
+    wideLowerLUT[0x388] = 0x3AD;
+    wideLowerLUT[0x389] = 0x3AE;
+    wideLowerLUT[0x38A] = 0x3AF;
+    wideLowerLUT[0x38C] = 0x3CC;
+    wideLowerLUT[0x38E] = 0x3CD;
+    wideLowerLUT[0x38F] = 0x3CE;
+    wideLowerLUT[0x3C2] = 0x3C3; // final sigma
+    wideClassLUT[0x37E] = CHAR_DELIM; // question mark
+    wideClassLUT[0x387] = CHAR_DELIM; // ano teleia
+
+    // Cyrillic, without the numeric sign and the combining marks at 0x482..0x489
+    for (int cp = 0x400; cp <= 0x4FF; cp++) {
+        if (cp < 0x482 || cp > 0x489) {
+            wideClassLUT[cp] = CHAR_LETTER;
+        }
+        if (cp <= 0x40F) {
+            wideLowerLUT[cp] = cp + 0x50;
+        }
+        else if (cp <= 0x42F) {
+            wideLowerLUT[cp] = cp + 0x20;
+        }
+        else if ((cp >= 0x460 && cp <= 0x481) || (cp >= 0x48A && cp <= 0x4BF) || (cp >= 0x4D0 && cp <= 0x4FF)) {
+            wideLowerLUT[cp] = cp | 1;
+        }
+        else if (cp >= 0x4C1 && cp <= 0x4CE && (cp & 1) == 1) {
+            wideLowerLUT[cp] = cp + 1;
         }
-        mb.slotID = slotID;
-        mb.offset = 0;
+    }
+    wideLowerLUT[0x4C0] = 0x4CF;
 
-        char* nullCharSlot = currBuf + shadowSize + bytesRead;
-        *nullCharSlot = '\0';
+    wideClassLUT[0xA0] = CHAR_DELIM; // no-break space
+    wideClassLUT[0xA1] = CHAR_DELIM;
+    wideClassLUT[0xAB] = CHAR_DELIM; // guillemets
+    wideClassLUT[0xBB] = CHAR_DELIM;
+    wideClassLUT[0xBF] = CHAR_DELIM;
+}
 
-        pcFull->Produce(&mb);
+// length and class of the UTF-8 character at p; a malformed byte is one CHAR_OTHER
+int MainThreadClass::DecodeChar(const char* p, int* cls, WORD* cp) {
+    UCHAR c = p[0];
+    *cp = c;
+    if (c < 0x80) {
+        *cls = isalphaLUT[c] ? CHAR_LETTER : isdelimiterLUT[c] ? CHAR_DELIM : CHAR_OTHER;
+        return 1;
+    }
+    *cls = CHAR_OTHER;
+    if (c < 0xC2 || ((UCHAR)p[1] & 0xC0) != 0x80) {
+        return 1;
+    }
+    if (c < 0xE0) {
+        *cp = (c & 0x1F) << 6 | ((UCHAR)p[1] & 0x3F);
+        *cls = wideClassLUT[*cp];
+        return 2;
+    }
+    if (((UCHAR)p[2] & 0xC0) != 0x80) {
+        return 1;
     }
+    if (c < 0xF0) {
+        DWORD u = (c & 0x0F) << 12 | ((UCHAR)p[1] & 0x3F) << 6 | ((UCHAR)p[2] & 0x3F);
+        // dashes, curly quotes, the ellipsis and the ideographic comma and full stop
+        if ((u >= 0x2013 && u <= 0x2014) || (u >= 0x2018 && u <= 0x2019) || (u >= 0x201C && u <= 0x201E) ||
+            u == 0x2026 || u == 0x3001 || u == 0x3002) {
+            *cls = CHAR_DELIM;
+        }
+        return 3;
+    }
+    if (c < 0xF5 && ((UCHAR)p[3] & 0xC0) == 0x80) {
+        return 4;
+    }
+    return 1;
+}
 
-    init_mergeTime = getTime();
+// class of the character ending in front of p; reads at most three bytes before p[-1]
+int MainThreadClass::DecodeCharBefore(const char* p, int* cls) {
+    WORD cp;
+    if ((UCHAR)p[-1] < 0x80) {
+        return DecodeChar(p - 1, cls, &cp);
+    }
+    for (int k = 1; k <= 3; k++) {
+        if (((UCHAR)p[-1 - k] & 0xC0) != 0x80) {
+            if (DecodeChar(p - 1 - k, cls, &cp) == k + 1) {
+                return k + 1;
+            }
+            break;
+        }
+    }
+    *cls = CHAR_OTHER;
+    return 1;
+}
 
-    int slot = 0;
-    for (int i = 0; i < nSlots; i++) {
-        pcEmpty->Consume(&slot);
+// lowers the multi-byte letters of word into out, which may be word itself
+DWORD FoldWord(const WORD* wideLowerLUT, const char* word, DWORD len, char* out) {
+    DWORD n = 0;
+    for (DWORD i = 0; i < len; i++) {
+        UCHAR c = word[i];
+        if (c < 0x80) {
+            out[n++] = c;
+            continue;
+        }
+        WORD cp = wideLowerLUT[(c & 0x1F) << 6 | ((UCHAR)word[++i] & 0x3F)];
+        if (cp < 0x80) {
+            out[n++] = (char)cp;
+        }
+        else {
+            out[n++] = (char)(0xC0 | cp >> 6);
+            out[n++] = (char)(0x80 | (cp & 0x3F));
+        }
     }
-    SetEvent(terminateEvent);
-    
-    final_mergeTime = getTime();
+    return n;
 }
 
-bool strcompare(char* s1, char* s2) {
-    while (*s1 != '\0') {
-        if (*s1 != *s2) {
-            return false;
+// bytes at the end of data that start a character it does not finish
+DWORD MainThreadClass::SplitCharBytes(const char* data, DWORD len) {
+    for (DWORD k = 1; k <= 3 && k <= len; k++) {
+        UCHAR c = data[len - k];
+        if ((c & 0xC0) != 0x80) {
+            DWORD need = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+            return need > k ? k : 0;
         }
-        s1++;
-        s2++;
     }
-    return true;
+    return 0;
 }
 
-unsigned int hashStr(char* str) {
-    unsigned char* s = (unsigned char*)str;
-    return ((unsigned int)(s[0]) << 16) + ((unsigned int)(s[1]) << 8) + (unsigned int)s[2];
+// first byte at or after curr that is not an ASCII letter
+DWORD MainThreadClass::SkipLetters(char* buf, DWORD curr, TokenCursor* tc) {
+    if (simdLevel == SIMD_SCALAR) {
+        while (isalphaLUT[(unsigned char)buf[curr]]) {
+            curr++;
+        }
+        return curr;
+    }
+    const char* p = buf + curr;
+    unsigned long bit;
+    while (true) {
+        Classify(tc, p);
+        UINT64 others = ~tc->alpha >> (p - tc->base);
+        if (simdWidth < 64) {
+            others &= (1ULL << (simdWidth - (p - tc->base))) - 1;
+        }
+        if (_BitScanForward64(&bit, others)) {
+            return (DWORD)(p - buf) + bit;
+        }
+        p = tc->base + simdWidth;
+    }
 }
 
-int MainThreadClass::FindNextWordStart(MyBuf cb, int off, DWORD* wordStart) {
+int MainThreadClass::FindNextWordStartUtf8(MyBuf cb, int off, DWORD* wordStart, TokenCursor* tc) {
     char* buf = cb.ptr;
     DWORD buf_size = cb.size;
 
-    while (off < buf_size) {
-        if (isalphaLUT[(unsigned char)buf[off]] == 1) {
-            *wordStart = off;
+    while ((DWORD)off < buf_size) {
+        DWORD start;
+        if (simdLevel != SIMD_SCALAR) {
+            // a block without high bytes is searched exactly like in the ASCII tokenizer
+            const char* p = buf + off;
+            Classify(tc, p);
+            UINT64 candidates = (tc->alpha | tc->high) >> (p - tc->base);
+            unsigned long bit;
+            if (!_BitScanForward64(&bit, candidates)) {
+                off = (int)(tc->base + simdWidth - buf);
+                continue;
+            }
+            start = off + bit;
+        }
+        else {
+            start = off;
+            while (start < buf_size && !isalphaLUT[(unsigned char)buf[start]] && (UCHAR)buf[start] < 0x80) {
+                start++;
+            }
+        }
+        if (start >= buf_size) {
+            return EOB;
+        }
+        if ((UCHAR)buf[start] < 0x80) {
+            *wordStart = start;
             return 0;
         }
-        off++;
+
+        int cls;
+        WORD cp;
+        int n = DecodeChar(buf + start, &cls, &cp);
+        if (cls == CHAR_LETTER) {
+            *wordStart = start;
+            return 0;
+        }
+        off = start + n;
     }
 
     return EOB;
 }
 
-int MainThreadClass::FindThisWordEnd(MyBuf cb, DWORD wordStart, DWORD* wordEnd, UINT64* hashKey) {
+// finds the end of a UTF-8 word and hashes its lower-case form
+int MainThreadClass::FindThisWordEndUtf8(MyBuf cb, DWORD wordStart, DWORD* wordEnd, UINT64* hashKey, TokenCursor* tc) {
     char* buf = cb.ptr;
-    DWORD buf_size = cb.size;
     DWORD curr = wordStart;
-    int index = 0;
-  
-    while (buf[curr] != '\0') {
-        if (!isalphaLUT[(unsigned char)buf[curr]]) {
-            *wordEnd = curr;
-            return 0;
+    DWORD wide = 0;
+
+    while (true) {
+        curr = SkipLetters(buf, curr, tc);
+        if ((UCHAR)buf[curr] < 0x80) {
+            break;
         }
-        *hashKey = (*hashKey + sboxLUT[(UCHAR)buf[curr]]) * 3;
-        curr++;
+        int cls;
+        WORD cp;
+        int n = DecodeChar(buf + curr, &cls, &cp);
+        if (cls != CHAR_LETTER) {
+            break;
+        }
+        curr += n;
+        wide += n - 1;
+    }
+    if (buf[curr] == '\0') {
+        return EOB;
     }
 
-    return EOB;
+    tc->wide = wide;
+    DWORD len = curr - wordStart;
+    if (len - wide >= 3 && len - wide <= 31) {
+        if (wide == 0) {
+            *hashKey = HashWord(buf + wordStart, len);
+        }
+        else {
+            tc->foldedLen = FoldWord(buf + wordStart, len, tc->folded + 8);
+            *hashKey = HashWord(tc->folded + 8, tc->foldedLen);
+        }
+    }
+    *wordEnd = curr;
+    return 0;
 }
 
-bool MainThreadClass::WordIsEligible(MyBuf cb, DWORD wordStart, DWORD wordEnd) {
+bool MainThreadClass::WordIsEligibleUtf8(MyBuf cb, DWORD wordStart, DWORD wordEnd, TokenCursor* tc) {
     char* buf = cb.ptr;
 
-    int len = wordEnd - wordStart;
-    if (len < 3 || len > 31) {
+    DWORD chars = wordEnd - wordStart - tc->wide;
+    if (chars < 3 || chars > 31) {
         return false;
     }
 
-    if (isdelimiterLUT[(unsigned char)buf[(int)wordStart - 1]] != 1 || isdelimiterLUT[(unsigned char)buf[(int)wordEnd]] != 1) {
-        return false;
+    int cls;
+    WORD cp;
+    if ((UCHAR)buf[(int)wordStart - 1] < 0x80) {
+        if (!IsDelimiter(tc, buf + (int)wordStart - 1)) {
+            return false;
+        }
     }
-
-    return true;
+    else {
+        DecodeCharBefore(buf + wordStart, &cls);
+        if (cls != CHAR_DELIM) {
+            return false;
+        }
+    }
+    if ((UCHAR)buf[wordEnd] < 0x80) {
+        return IsDelimiter(tc, buf + wordEnd);
+    }
+    DecodeChar(buf + wordEnd, &cls, &cp);
+    return cls == CHAR_DELIM;
 }
 
-void MainThreadClass::ProcessData() {
+void MainThreadClass::ProcessData(int worker) {
+    // pinned before the tables are made, so that their memory comes from this node
+    int node = 0;
+    if (placement == PLACE_NUMA) {
+        node = numa.PlaceWorker(worker);
+    }
+    else if (worker < 8 * (int)sizeof(DWORD_PTR)) {
+        SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << worker);
+    }
+
+    if (readerMode == READER_MAPPED) {
+        LowerMemoryPriority(); // the workers fault the file pages in themselves
+    }
+
     MyBuf cb;
     DWORD wordStart;
     DWORD wordEnd;
     DWORD wordLen;
     UINT64 hashKey;
-    HashTable* local_HT = new HashTable(nB);
-
-    while (pcFull->Consume(&cb) != -1) {
+    SharedTable* shared = nShards != 0 ? main_shards->shard[0]->shared : nullptr;
+    TableShards* local = countMode == COUNT_HEAVY ? new TableShards(new SpaceSaving(heavyCounters, packedKeys))
+        : countMode == COUNT_ESTIMATE ? new TableShards(new HyperLogLog())
+        : new TableShards(nShards, nB, packedKeys, tableEngine, shared);
+    // a sketch register is always in cache, there is nothing to prefetch
+    InsertBatch* batch = insertBatch > 1 && countMode != COUNT_ESTIMATE ? new InsertBatch() : nullptr;
+    TokenCursor tc;
+    tc.wide = 0;
+
+    while (GetChunk(&cb, node) != -1) {
+        if (shared != nullptr) {
+            AcquireSRWLockShared(&shared->lock); // keeps the table from doubling under the chunk
+        }
+        tc.base = nullptr; // the slot may hold new data at the same address
         int off = 0;
         DWORD t_words = 0;
         DWORD i_words = 0;
         DWORD wordStart = 0;
         DWORD wordEnd = 0;
 
-        if (!cb.first) {
-            if (FindThisWordEnd(cb, wordStart, &wordEnd, &hashKey) == EOB) {
-                pcEmpty->Produce(&cb.slotID);
+        if (cb.stitch) {
+            off = SplitEdges(&cb, local, &t_words, &i_words);
+        }
+        else if (!cb.first) {
+            bool skip = true;
+            if (utf8 && ((UCHAR)cb.ptr[0] & 0xC0) == 0x80) {
+                // the chunk starts inside a character; a letter there continues the previous word
+                int cls;
+                while (wordStart < 3 && ((UCHAR)cb.ptr[wordStart] & 0xC0) == 0x80) {
+                    wordStart++;
+                }
+                DecodeCharBefore(cb.ptr + wordStart, &cls);
+                skip = cls == CHAR_LETTER;
+            }
+            if (!skip) {
+                off = wordStart;
+            }
+            else if (FindThisWordEnd(cb, wordStart, &wordEnd, &hashKey, &tc) == EOB) {
+                if (shared != nullptr) {
+                    ReleaseSRWLockShared(&shared->lock);
+                }
+                ReleaseChunk(&cb);
                 EnterCriticalSection(&cs);
                 invalid_words += i_words;
                 total_words += t_words;
+                inputs[cb.fileID].invalid += i_words;
+                inputs[cb.fileID].words += t_words;
                 activeThreads--;
                 LeaveCriticalSection(&cs);
                 continue;
             }
-            off = wordEnd + 1;
+            else {
+                off = wordEnd + 1;
+            }
         }
             
         while (off < cb.size) {
-            if (FindNextWordStart(cb, off, &wordStart) == EOB) {
+            if (FindNextWordStart(cb, off, &wordStart, &tc) == EOB) {
                 break;
             }
 
             hashKey = 0;
-            if (FindThisWordEnd(cb, wordStart, &wordEnd, &hashKey) == EOB) {
+            if (FindThisWordEnd(cb, wordStart, &wordEnd, &hashKey, &tc) == EOB) {
                 i_words++;
                 t_words++;
                 break;
             }
             wordLen = wordEnd - wordStart;
-            if (WordIsEligible(cb, wordStart, wordEnd)) {
-                bool found;
-                int valueSize = sizeof(HashValue) + wordLen + 1;
-                HashValue* hv = local_HT->FindInsertKey(hashKey, valueSize, found);
-                if (found) {
-                    hv->counter++;
+            if (WordIsEligible(cb, wordStart, wordEnd, &tc)) {
+                if (batch != nullptr) {
+                    if (tc.wide != 0) {
+                        BatchWord(batch, local, hashKey, tc.folded + 8, tc.foldedLen, true);
+                    }
+                    else {
+                        BatchWord(batch, local, hashKey, cb.ptr + wordStart, wordLen, false);
+                    }
+                }
+                else if (tc.wide != 0) {
+                    CountWord(local, hashKey, tc.folded + 8, tc.foldedLen);
                 }
                 else {
-                    hv->counter = 1;
-                    memcpy(hv->GetWordPtr(), cb.ptr + wordStart, wordLen);
-                    char* nullChar = hv->GetWordPtr() + wordLen;
-                    *nullChar = '\0';
+                    CountWord(local, hashKey, cb.ptr + wordStart, wordLen);
                 }
             }
             else {
@@ -776,80 +5790,197 @@ void MainThreadClass::ProcessData() {
             off = wordEnd + 1;
         }
 
-        pcEmpty->Produce(&cb.slotID);
+        if (batch != nullptr) {
+            FlushBatch(batch);
+        }
+        if (shared != nullptr) {
+            ReleaseSRWLockShared(&shared->lock);
+        }
+        ReleaseChunk(&cb);
         EnterCriticalSection(&cs);
         invalid_words += i_words;
         total_words += t_words;
-        if (local_HT->max_depth > max_lookup_depth) {
-            max_lookup_depth = local_HT->max_depth;
+        inputs[cb.fileID].invalid += i_words;
+        inputs[cb.fileID].words += t_words;
+        lookup_depth = 0;
+        num_lookups = 0;
+        for (int i = 0; i < nShards; i++) {
+            HashTable* part = local->shard[i];
+            if (part->max_depth > max_lookup_depth) {
+                max_lookup_depth = part->max_depth;
+            }
+            lookup_depth += part->searches;
+            num_lookups += part->lookup_total;
         }
-        lookup_depth = local_HT->searches;
-        num_lookups = local_HT->lookup_total;
         activeThreads--;
         LeaveCriticalSection(&cs);
     }
 
+    if (shared == nullptr) {
+        // the merge starts once every worker has its shards complete
+        EnterCriticalSection(&cs);
+        workerShards.push_back(local);
+        bool last = --countingWorkers == 0;
+        LeaveCriticalSection(&cs);
+        if (last) {
+            SetEvent(mergeEvent);
+        }
+        WaitForSingleObject(mergeEvent, INFINITE);
+        MergeShards();
+    }
+
     EnterCriticalSection(&cs);
+    if (shared != nullptr) {
+        // every word is in the shared table already
+        main_shards->shard[0]->size += local->shard[0]->size;
+    }
+    if (--mergingWorkers == 0) {
+        final_mergeTime = getTime();
+    }
+    LeaveCriticalSection(&cs);
 
-    DWORD count = 0;
-    char* wordPtr = nullptr;
-    bool found;
-    int valueSize;
-    int wL;
+    return;
+}
+
+// fills the untaken shards of the result from the same shard of every worker, without locks
+void MainThreadClass::MergeShards() {
+    if (countMode == COUNT_HEAVY) {
+        if (InterlockedIncrement(&nextShard) == 1) {
+            std::vector<SpaceSaving*> summaries;
+            for (size_t w = 0; w < workerShards.size(); w++) {
+                summaries.push_back(workerShards[w]->heavy);
+            }
+            main_shards->heavy->Merge(summaries);
+        }
+        return;
+    }
+    if (countMode == COUNT_ESTIMATE) {
+        if (InterlockedIncrement(&nextShard) == 1) {
+            for (size_t w = 0; w < workerShards.size(); w++) {
+                main_shards->sketch->Merge(workerShards[w]->sketch);
+            }
+        }
+        return;
+    }
+    for (LONG s; (s = InterlockedIncrement(&nextShard) - 1) < nShards; ) {
+        HashTable* dest = main_shards->shard[s];
+        for (size_t w = 0; w < workerShards.size(); w++) {
+            HashTable* src = workerShards[w]->shard[s];
+            if (packedKeys) {
+                // exact keys merge without touching a string
+                src->ForEachPacked([&](const PackedKey& key, DWORD counter) {
+                    bool found;
+                    *dest->FindInsertPacked(key, PackedHash(key), found) += counter;
+                });
+                src->Release();
+                continue;
+            }
+            src->ForEachWord([&](UINT64 hashKey, char* word, DWORD counter) {
+                bool found;
+                *dest->FindInsertKey(hashKey, word, (DWORD)strlen(word), found) += counter;
+            });
+            src->Release(); // the shards merged later grow into its memory
+        }
+    }
+}
 
-    for (int i = 0; i < local_HT->nBins; i++) {
-        if (local_HT->hash[i] != -1) {
-            HashHeader* curr_hH = (HashHeader*)(local_HT->mainHashBuf + local_HT->hash[i]);
-            HashValue* curr_hV = (HashValue*)(curr_hH + 1);
-            while (curr_hH->next_offset != -1) {
-                DWORD count = curr_hV->counter;
-                char* wordPtr = curr_hV->GetWordPtr();
+// commits chunk bytes plus padding of slots [from, to), slot i on node i % nNodes
+void MainThreadClass::CommitSlots(DWORD from, DWORD to, DWORD chunk) {
+    for (DWORD i = from; i < to; i++) {
+        DWORD node = nNodes > 1 ? numa.node[i % nNodes] : NUMA_NO_PREFERRED_NODE;
+        if (VirtualAllocExNuma(GetCurrentProcess(), mega_buf + (UINT64)i * slotSize, chunk + padding, MEM_COMMIT, PAGE_READWRITE, node) == NULL) {
+            printf("VirtualAlloc error: %d\n", GetLastError());
+            exit(-1);
+        }
+    }
+}
 
-                found = false;
-                wL = strlen(wordPtr);
-                valueSize = sizeof(HashValue) + wL + 1;
-                hashKey = curr_hH->hash;
-                HashValue* hv = main_hT->FindInsertKey(hashKey, valueSize, found);
-                if (found) {
-                    hv->counter += count;
-                }
-                else {
-                    hv->counter = count;
-                    memcpy(hv->GetWordPtr(), wordPtr, wL);
-                    char* nullChar = hv->GetWordPtr() + wL;
-                    *nullChar = '\0';
-                }
+// settles B and the slot count during the first seconds of the run from read rate and wait times
+void MainThreadClass::Tune() {
+    if (readerMode == READER_MAPPED) {
+        return; // the workers read the view directly, there is no queue to size
+    }
 
-                curr_hH = (HashHeader*)(local_HT->mainHashBuf + curr_hH->next_offset);
-                curr_hV = (HashValue*)(curr_hH + 1);
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    int nProducers = (readerMode == READER_PARALLEL || readerMode == READER_BZIP2) ? nReaders : 1;
+    bool searchB = readerMode == READER_SYNC;
+    double bestRate = 0;
+    int bestExp = chunkExp;
+
+    for (int epoch = 0; epoch < TUNE_EPOCHS; epoch++) {
+        UINT64 bytes = totalBytesRead;
+        LONG64 idle = idleTicks;
+        LONG64 stall = stallTicks;
+        LONGLONG start = getTime();
+        double full = 0;
+        double empty = 0;
+        for (int i = 0; i < TUNE_EPOCH_SAMPLES; i++) {
+            if (WaitForSingleObject(terminateEvent, TUNE_SAMPLE_MS) == WAIT_OBJECT_0) {
+                return;
+            }
+            for (int n = 0; n < nNodes; n++) {
+                full += pcNear[n]->Count();
             }
-            count = curr_hV->counter;
-            wordPtr = curr_hV->GetWordPtr();
+            empty += pcEmpty->Count();
+        }
 
-            found = false;
-            wL = strlen(wordPtr);
-            valueSize = sizeof(HashValue) + wL + 1;
-            hashKey = curr_hH->hash;
-            HashValue* hv = main_hT->FindInsertKey(hashKey, valueSize, found);
-            if (found) {
-                hv->counter += count;
+        double ticks = (double)(getTime() - start);
+        double rate = (totalBytesRead - bytes) / (ticks / frequency.QuadPart);
+        double idleShare = (idleTicks - idle) / (ticks * cpu.cpus);
+        double stallShare = (stallTicks - stall) / (ticks * nProducers);
+        printf("tune: chunk 2^%d, %d slots: %.2f MB/s, full %.1f, empty %.1f, idle %.0f%%, stall %.0f%%\n",
+            chunkExp, nSlots, rate / 1000000.0, full / TUNE_EPOCH_SAMPLES, empty / TUNE_EPOCH_SAMPLES,
+            idleShare * 100, stallShare * 100);
+        fprintf(file, "tune: chunk 2^%d, %d slots: %.2f MB/s, full %.1f, empty %.1f, idle %.0f%%, stall %.0f%%\n",
+            chunkExp, nSlots, rate / 1000000.0, full / TUNE_EPOCH_SAMPLES, empty / TUNE_EPOCH_SAMPLES,
+            idleShare * 100, stallShare * 100);
+        if (epoch == 0) {
+            continue; // the first measurement includes start-up
+        }
+
+        EnterCriticalSection(&cs);
+        if (searchB) {
+            if (rate > bestRate * 1.05) {
+                bestRate = rate;
+                bestExp = chunkExp;
+                // busy consumers mean the tokenizer is the limit, larger reads will not help
+                searchB = chunkExp < TUNE_MAX_EXP && idleShare > 0.05;
             }
             else {
-                hv->counter = count;
-                memcpy(hv->GetWordPtr(), wordPtr, wL);
-                char* nullChar = hv->GetWordPtr() + wL;
-                *nullChar = '\0';
+                searchB = false;
+            }
+            int exp = searchB ? chunkExp + 1 : bestExp;
+            if (exp != chunkExp) {
+                chunkExp = exp;
+                // the sync reader takes B before every read, so the slots must hold it by then
+                CommitSlots(0, nSlots, 1 << exp);
+                InterlockedExchange((volatile LONG*)&B, 1 << exp);
             }
         }
+        else if (stallShare > 0.1 && idleShare > 0.1 && nSlots < maxSlots) {
+            DWORD add = cpu.cpus / 2 > 0 ? cpu.cpus / 2 : 1;
+            if (nSlots + add > maxSlots) {
+                add = maxSlots - nSlots;
+            }
+            CommitSlots(nSlots, nSlots + add, B);
+            for (DWORD i = 0; i < add; i++) {
+                // count the slot before handing it out, the readers wait for nSlots slots at the end
+                int slotID = nSlots;
+                nSlots++;
+                pcEmpty->Produce(&slotID);
+            }
+        }
+        LeaveCriticalSection(&cs);
     }
-
-    LeaveCriticalSection(&cs);
-
-    return;
 }
 
 void MainThreadClass::TrackStats() {
-    UINT64 lastBytes = 0;
+    if (autoTune) {
+        Tune();
+    }
+
+    UINT64 lastBytes = totalBytesRead;
     while (true) {
         DWORD dwWaitResult = WaitForSingleObject(terminateEvent, 2000);
         if (dwWaitResult == WAIT_OBJECT_0) {
@@ -895,17 +6026,72 @@ DWORD WINAPI InitializeThread(LPVOID p) {
         t->lpMTC->DiskRead();
     }
     else {
-        SetThreadAffinityMask(GetCurrentThread(), 1 << (t->threadID - 2));
-        t->lpMTC->ProcessData();
+        t->lpMTC->ProcessData(t->threadID - 2);
     }
 
     return 0;
 }
 
+// indexer -lookup <index> <word|rank> ...: digits ask for a rank, anything else for a folded word
+int LookupMain(int argc, char* argv[]) {
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    LONGLONG start = getTime();
+    UCHAR wideClassLUT[0x800];
+    WORD wideLowerLUT[0x800];
+    BuildWideTables(wideClassLUT, wideLowerLUT);
+    WordIndex index;
+    if (!index.Open(argv[2])) {
+        return 1;
+    }
+    char words[32], total[32];
+    *PutNumber(words, index.header->words) = '\0';
+    *PutNumber(total, index.header->total) = '\0';
+    printf("Index: %s words, %s in total, opened in %.1f us\n", words, total, (double)(getTime() - start) * 1000000 / frequency.QuadPart);
+
+    for (int i = 3; i < argc; i++) {
+        const char* query = argv[i];
+        LONGLONG t0 = getTime();
+        char word[INDEX_WORD_MAX];
+        DWORD count = 0;
+        UINT64 rank = 0;
+        bool found = false;
+        if (query[strspn(query, "0123456789")] == '\0') {
+            rank = _strtoui64(query, NULL, 10);
+            found = index.At(rank, word, &count);
+        }
+        else if (strlen(query) < INDEX_WORD_MAX) {
+            DWORD len = FoldWord(wideLowerLUT, query, (DWORD)strlen(query), word);
+            for (DWORD c = 0; c < len; c++) {
+                word[c] = word[c] >= 'A' && word[c] <= 'Z' ? word[c] + ('a' - 'A') : word[c];
+            }
+            word[len] = '\0';
+            found = index.Find(word, &count, &rank);
+        }
+        double us = (double)(getTime() - t0) * 1000000 / frequency.QuadPart;
+        if (found) {
+            char r[32], c[32];
+            *PutNumber(r, rank) = '\0';
+            *PutNumber(c, count) = '\0';
+            printf("[%s] %s = %s (%.1f us)\n", r, word, c, us);
+        }
+        else {
+            printf("%s: not found (%.1f us)\n", query, us);
+        }
+    }
+    return 0;
+}
+
 int main(int argc, char* argv[]) {
+    if (argc >= 3 && strcmp(argv[1], "-lookup") == 0) {
+        return LookupMain(argc, argv);
+    }
+
     //Check Sysargs
-    if (argc != 3) {
-        printf("(-) Usage: <buf_size> <wikiversion.txt>\n");
+    RunConfig cfg;
+    if (!cfg.Parse(argc, argv)) {
+        printf("(-) Usage: <buf_size|auto> <wikiversion.txt|.bz2|dir|pattern> [more inputs] [-io sync|overlapped|mapped|parallel] [-qd reads_in_flight] [-readers n] [-index multistream-index.txt[.bz2]] [-cache normal|stream] [-simd scalar|sse42|avx2|avx512] [-hash sbox|mix] [-charset ascii|utf8] [-filter none|wiki] [-keys packed|hash] [-table swiss|chain|shared] [-batch words] [-pages large|normal] [-place numa|none] [-count exact|heavy|estimate] [-counters n] [-parts n] [-top k] [-save words.idx]\n");
+        printf("(-) Usage: -lookup <words.idx> <word|rank> [more queries]\n");
         return 1;
     }
 
@@ -925,7 +6111,7 @@ int main(int argc, char* argv[]) {
     //Initialize Threads
     HANDLE* threadHandles = new HANDLE[K+2];
     ThreadParams* t = new ThreadParams[K+2];
-    MainThreadClass mtc(num_bins, atoi(argv[1]), argv[2], file);
+    MainThreadClass mtc(num_bins, K, cfg, file);
 
     for (int i = 0; i < K+2; i++) {
         t[i].threadID = i;
@@ -960,17 +6146,90 @@ int main(int argc, char* argv[]) {
     fprintf(file, "Execution time: %.2f sec, %.1f MB/s, %.1fM wps\n", total_delta, (mtc.fileSize/total_delta)/1000000, (mtc.total_words/total_delta)/1000000);
     printf("\nMerge delay: %.0f ms\n", total_merge_delta * 1000);
     printf("Execution time: %.2f sec, %.1f MB/s, %.1fM wps\n", total_delta, (mtc.fileSize / total_delta) / 1000000, (mtc.total_words / total_delta) / 1000000);
-    printf("\nUnique: %s\n", formatNumber(mtc.main_hT->size));
-    printf("Invalid: %s\n", formatNumber(mtc.invalid_words));
-    printf("Total: %s\n", formatNumber(mtc.total_words));
-    fprintf(file, "\nUnique: %s\n", formatNumber(mtc.main_hT->size));
-    fprintf(file, "Invalid: %s\n", formatNumber(mtc.invalid_words));
-    fprintf(file, "Total: %s\n\n", formatNumber(mtc.total_words));
-    mtc.main_hT->PrintContents(file);
+    const char* kernelNames[] = { "scalar", "SSE4.2", "AVX2", "AVX-512" };
+    const char* hashNames[] = { "sbox", "mix" };
+    const char* charsetName = mtc.utf8 ? "UTF-8" : "ASCII";
+    const char* filterName = mtc.filterMode == FILTER_WIKI ? ", wiki markup filtered" : "";
+    char keyName[32];
+    _snprintf(keyName, sizeof(keyName), mtc.packedKeys ? "packed keys" : "%s hash", hashNames[mtc.hashMode]);
+    fprintf(file, "Tokenizer: %s, %s, %s%s\n", kernelNames[mtc.simdLevel], charsetName, keyName, filterName);
+    printf("Tokenizer: %s, %s, %s%s\n", kernelNames[mtc.simdLevel], charsetName, keyName, filterName);
+    if (tablePages.largePage != 0) {
+        char n[32];
+        *PutNumber(n, tablePages.largePage) = '\0';
+        fprintf(file, "Large pages: %s bytes\n", n);
+        printf("Large pages: %s bytes\n", n);
+    }
+    if (mtc.nNodes > 1) {
+        fprintf(file, "NUMA: %d nodes, workers, slots and tables spread over them\n", mtc.nNodes);
+        printf("NUMA: %d nodes, workers, slots and tables spread over them\n", mtc.nNodes);
+    }
+    if (mtc.autoTune) {
+        char n[32];
+        *PutNumber(n, mtc.B) = '\0';
+        fprintf(file, "Tuned: %s byte chunks, %d slots\n", n, mtc.nSlots);
+        printf("Tuned: %s byte chunks, %d slots\n", n, mtc.nSlots);
+    }
+    if (mtc.readerMode == READER_BZIP2) {
+        char bytes[32], streams[32];
+        *PutNumber(bytes, mtc.decompressedBytes) = '\0';
+        *PutNumber(streams, mtc.nStreams) = '\0';
+        fprintf(file, "Decompressed: %s bytes from %s streams\n", bytes, streams);
+        printf("Decompressed: %s bytes from %s streams\n", bytes, streams);
+    }
+    SpaceSaving* heavy = mtc.main_shards->heavy;
+    if (heavy != nullptr) {
+        char k[32], error[32];
+        *PutNumber(k, heavy->k) = '\0';
+        *PutNumber(error, heavy->MaxError()) = '\0';
+        fprintf(file, "Heavy hitters: %s counters, counts at most %s high\n", k, error);
+        printf("Heavy hitters: %s counters, counts at most %s high\n", k, error);
+    }
+    HyperLogLog* sketch = mtc.main_shards->sketch;
+    if (sketch != nullptr) {
+        char n[32];
+        *PutNumber(n, HLL_REGISTERS) = '\0';
+        fprintf(file, "Estimated: HyperLogLog of %s registers, typically within %.1f%%\n", n, 104.0 / sqrt((double)HLL_REGISTERS));
+        printf("Estimated: HyperLogLog of %s registers, typically within %.1f%%\n", n, 104.0 / sqrt((double)HLL_REGISTERS));
+    }
+    // words pushed out of a summary were not counted, so only a lower bound is known
+    const char* uniqueBound = heavy != nullptr && !heavy->exact ? "more than " : sketch != nullptr ? "about " : "";
+    UINT64 unique = sketch != nullptr ? sketch->Estimate() : mtc.main_shards->Size();
+    char uniqueText[32], invalidText[32], totalText[32];
+    *PutNumber(uniqueText, unique) = '\0';
+    *PutNumber(invalidText, mtc.invalid_words) = '\0';
+    *PutNumber(totalText, mtc.total_words) = '\0';
+    printf("\nUnique: %s%s\n", uniqueBound, uniqueText);
+    printf("Invalid: %s\n", invalidText);
+    printf("Total: %s\n", totalText);
+    fprintf(file, "\nUnique: %s%s\n", uniqueBound, uniqueText);
+    fprintf(file, "Invalid: %s\n", invalidText);
+    fprintf(file, "Total: %s\n\n", totalText);
+    if (mtc.inputs.size() > 1) {
+        for (size_t i = 0; i < mtc.inputs.size(); i++) {
+            InputFile& in = mtc.inputs[i];
+            char bytes[32], words[32], invalid[32];
+            *PutNumber(bytes, in.bytes) = '\0';
+            *PutNumber(words, in.words) = '\0';
+            *PutNumber(invalid, in.invalid) = '\0';
+            fprintf(file, "%s: %s bytes, %s words, %s invalid\n", in.name, bytes, words, invalid);
+        }
+        fprintf(file, "\n");
+    }
+    if (cfg.reportParts > 1 && sketch == nullptr) {
+        fprintf(file, "Listing: report-1.txt to report-%d.txt\n", cfg.reportParts);
+    }
+    if (cfg.top > 0 && sketch == nullptr) {
+        char n[32];
+        *PutNumber(n, cfg.top) = '\0';
+        fprintf(file, "Listing: top %s\n", n);
+    }
+    ReportWriter report(file, K, cfg.reportParts, cfg.top, cfg.saveName);
+    mtc.main_shards->PrintContents(report);
 
     fclose(file);
 
-    //mtc.main_hT->tallyWordLengths();
+    //mtc.main_shards->shard[0]->tallyWordLengths();
 
     ShellExecute(NULL, "open", "report.txt", NULL, NULL, SW_SHOWNORMAL);
 }